@@ -2,43 +2,1220 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "cache.h"
 #include "jbod.h"
+#include "net.h"
 
-static cache_entry_t *cache = NULL;
+#define SNAPSHOT_MAGIC 0x4a424443  // "JBDC"
+#define SNAPSHOT_VERSION 2
+#define SHARED_MAGIC 0x4a424353  // "JBCS"
+#define SHARED_MAX_USERS 64  // Processes that can attach to a shared cache at the same time
+#define SHARED_WAIT_MS 1000  // How long to wait for the creator of a shared cache to set it up
+#define SHARED_STRIPES 16  // Locks of a shared cache, each covering a range of buckets
+#define REHASH_STEP 8  // Buckets moved to the new index by every cache operation while the cache grows
+#define CACHE_MAX_ENTRIES 4096
+#define CHUNK_ENTRIES 256  // Entries are allocated this many at a time, as inserts fill the cache up
+#define TIER2_MAX_KEYS (JBOD_NUM_DISKS * JBOD_MAX_BACKENDS * JBOD_NUM_BLOCKS_PER_DISK)  // Blocks of the largest volume
+#define SKETCH_DEPTH 4      // Rows of the count-min sketch, each hashed differently
+#define SKETCH_MAX_COUNT 15  // Counters saturate like the 4 bit ones of TinyLFU
+#define SKETCH_SAMPLE 10    // All counters are halved after this many accesses per cache entry
+#define WINDOW_PERCENT 1    // Share of the entries that make up the admission window
+#define WINDOW_MIN 8        // Smallest window, as long as one entry is left outside of it
+
+// Layout of the snapshot file: this header followed by |num_entries| cache_entry_t.
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  int32_t num_entries;
+  int32_t clock;
+} cache_snapshot_header_t;
+
+// The entries live in chunks of CHUNK_ENTRIES, so growing the cache never moves the ones already there and the
+// memory of an entry is only allocated once an insert needs it. Positions below num_allocated have a chunk. The
+// valid entries are always packed at the front; after a shrink there can be more of them than cache_size until
+// the following cache operations have evicted the excess.
+static cache_entry_t *chunks[CACHE_MAX_ENTRIES / CHUNK_ENTRIES];
+static int num_allocated = 0;
 static int cache_size = 0;
-static int clock = 0;
+static int access_clock = 0;
 static int num_queries = 0;
 static int num_hits = 0;
 
+// Header of a cache shared between processes through a named shared memory segment. The segment holds this
+// header, then the buckets of the index, then the entries. Entries and chains refer to each other by position, so
+// every process can map the segment at a different address.
+//
+// Lookups only take the lock of the stripe their block hashes to, so processes reading different blocks don't
+// wait for each other. Inserts are the only ones that change the chains or which block an entry holds. They take
+// |lock| to run one at a time, which lets them walk the chains and pick a victim without the stripes, and only
+// lock the stripes of the new block and of the victim to change them.
+typedef struct {
+  uint32_t magic;
+  int32_t ready;        // Set last by the process that creates the segment, the others wait for it
+  int32_t num_entries;
+  int32_t num_buckets;
+  int32_t clock;
+  pid_t users[SHARED_MAX_USERS];  // Processes attached, 0 for a free slot; the last one to detach removes the segment
+  pthread_mutex_t lock;  // Robust, so a process that dies holding it does not block the others for good
+  pthread_mutex_t stripes[SHARED_STRIPES];  // Robust too, stripe i covers the i-th range of buckets
+} cache_shared_header_t;
+
+static char *shared_name = NULL;
+static cache_shared_header_t *shared = NULL;
+static size_t shared_size = 0;
+
+static char *snapshot_file = NULL;
+static int num_restored = 0;  // Entries at the front of the cache that came from the snapshot and still need checking
+
+// Second tier: blocks evicted from memory are demoted to a file, one block per slot, and promoted back to memory
+// when they are looked up again. A block is only ever in one of the two tiers. The slots in use are linked in the
+// order they were demoted, which is also their LRU order since a hit takes the block out of the file.
+typedef struct {
+  int key;   // disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num, -1 if the slot is free
+  int prev;  // Previous (older) and next (newer) slot in demotion order; free slots are chained through next
+  int next;
+} tier2_slot_t;
+
+static char *tier2_file = NULL;
+static int tier2_size = 0;
+static int tier2_fd = -1;
+static tier2_slot_t *tier2_slots = NULL;
+static int *tier2_slot_of = NULL;  // Slot holding each block, -1 if the block is not in the file
+static int tier2_oldest = -1;
+static int tier2_newest = -1;
+static int tier2_free = -1;
+static int tier2_queries = 0;
+static int tier2_hits = 0;
+static int tier2_demoted = 0;
+
+// Hash index from (disk_num, block_num) to the position of the entry in the cache. Each bucket is a chain of
+// entries linked through cache_entry_t.next. While the cache grows the index is rehashed a few buckets at a time:
+// entries still in old_index are moved to new_index by every cache operation until old_index is empty.
+typedef struct {
+  int *buckets;      // First entry of each chain, -1 if the bucket is empty
+  int num_buckets;   // Always a power of two
+  int shift;         // 32 - log2(num_buckets), the bucket is the top bits of the hash
+} cache_index_t;
+
+static cache_index_t new_index = { NULL, 0, 0 };
+static cache_index_t old_index = { NULL, 0, 0 };
+static int rehash_pos = 0;  // Next bucket of old_index to move
+
+// Admission filter (W-TinyLFU). Accesses are counted in a count-min sketch whose counters are halved every
+// SKETCH_SAMPLE * cache_size accesses, so it estimates how often a block was used recently. A block that missed
+// always enters a small admission window of the full cache, and when it has to leave the window it only stays
+// cached if its estimate is higher than the one of the least recently used entry outside the window.
+static bool admission = false;
+static uint8_t *sketch = NULL;  // SKETCH_DEPTH rows of sketch_width counters
+static bool *in_window = NULL;  // in_window[i] is true while entry i is in the admission window
+static int window_count = 0;
+static int sketch_width = 0;
+static int sketch_shift = 0;
+static int sketch_accesses = 0;
+static int admission_candidates = 0;
+static int admission_admitted = 0;
+static const uint32_t sketch_seeds[SKETCH_DEPTH] = { 2654435761u, 2246822519u, 3266489917u, 668265263u };
+
+// Plain LRU cache of the same size run over the same accesses while the filter is on, only the keys of the
+// blocks are kept. Its hits are what the cache would have scored without the filter.
+typedef struct {
+  int key;          // disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num
+  int access_time;
+} shadow_entry_t;
+
+static shadow_entry_t *shadow = NULL;  // Room for CACHE_MAX_ENTRIES, the first shadow_used are taken
+static int shadow_used = 0;
+static int shadow_clock = 0;
+static int shadow_hits = 0;
+
+
+// The clock of a shared cache is in the segment, so the entries of every process are ordered by the same one.
+// Lookups of different stripes tick it at the same time, hence the atomics here and on the access times.
+static int tick(void)
+{
+  int32_t *clock = shared != NULL ? &shared->clock : &access_clock;
+  return __atomic_add_fetch(clock, 1, __ATOMIC_RELAXED);
+}
+
+static cache_entry_t *entry_at(int entry)
+{
+  return &chunks[entry / CHUNK_ENTRIES][entry % CHUNK_ENTRIES];
+}
+
+static bool entry_valid(int entry)
+{
+  return entry < num_allocated && entry_at(entry)->valid == true;
+}
+
+// Allocates the chunks up to the one holding |entry|, their entries start out invalid
+static int entry_alloc(int entry)
+{
+  while (num_allocated <= entry)
+  {
+    cache_entry_t *chunk = calloc(CHUNK_ENTRIES, sizeof(cache_entry_t));
+    if (chunk == NULL)
+    {
+      return -1;
+    }
+    chunks[num_allocated / CHUNK_ENTRIES] = chunk;
+    num_allocated += CHUNK_ENTRIES;
+  }
+  return 1;
+}
+
+// Number of valid entries. They are packed at the front of the cache, so the first invalid one is bisected for.
+static int count_valid(void)
+{
+  int low = 0;
+  int high = num_allocated;
+  while (low < high)
+  {
+    int middle = (low + high) / 2;
+    if (entry_at(middle)->valid == true)
+    {
+      low = middle + 1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+// The least recently used of the first |used| entries, scanned a chunk at a time since it runs on every miss
+static int lru_entry(int used)
+{
+  int lru = 0;
+  int lru_time = __atomic_load_n(&chunks[0][0].access_time, __ATOMIC_RELAXED);
+  for (int start = 0; start < used; start += CHUNK_ENTRIES)
+  {
+    const cache_entry_t *chunk = chunks[start / CHUNK_ENTRIES];
+    int count = used - start < CHUNK_ENTRIES ? used - start : CHUNK_ENTRIES;
+    for (int i = 0; i < count; i++)
+    {
+      int access_time = __atomic_load_n(&chunk[i].access_time, __ATOMIC_RELAXED);
+      if (access_time < lru_time)
+      {
+        lru = start + i;
+        lru_time = access_time;
+      }
+    }
+  }
+  return lru;
+}
+
+static void make_recent(int entry)
+{
+  __atomic_store_n(&entry_at(entry)->access_time, tick(), __ATOMIC_RELAXED);
+}
+
+// Empties a shared cache, when the segment is created and whenever what it holds can't be trusted anymore
+static void shared_clear(cache_shared_header_t *header)
+{
+  int *buckets = (int *) (header + 1);
+  cache_entry_t *entries = (cache_entry_t *) (buckets + header->num_buckets);
+
+  for (int i = 0; i < header->num_buckets; i++)
+  {
+    buckets[i] = -1;
+  }
+  for (int i = 0; i < header->num_entries; i++)
+  {
+    entries[i].valid = false;
+  }
+  header->clock = 0;
+}
+
+// Taken by inserts and to attach or detach. An insert that dies holding it also holds the stripes it was
+// changing, those are repaired when they are taken next.
+static void lock_cache(void)
+{
+  if (shared != NULL && pthread_mutex_lock(&shared->lock) == EOWNERDEAD)
+  {
+    pthread_mutex_consistent(&shared->lock);
+  }
+}
+
+static void unlock_cache(void)
+{
+  if (shared != NULL)
+  {
+    pthread_mutex_unlock(&shared->lock);
+  }
+}
+
+// The top bits of a multiplicative hash, like sketch_counter: masking the low ones would be a plain modulo
+static int index_bucket(const cache_index_t *index, int disk_num, int block_num)
+{
+  uint32_t key = (uint32_t) disk_num * JBOD_NUM_BLOCKS_PER_DISK + (uint32_t) block_num;
+  return (key * 2654435761u) >> index->shift;
+}
+
+// About one entry per bucket keeps the chains short. At least two, so the shift stays below 32.
+static int index_num_buckets(int num_entries)
+{
+  int num_buckets = 2;
+  while (num_buckets < num_entries)
+  {
+    num_buckets *= 2;
+  }
+  return num_buckets;
+}
+
+static void index_set_size(cache_index_t *index, int num_buckets)
+{
+  index->num_buckets = num_buckets;
+  index->shift = 32;
+  for (int n = num_buckets; n > 1; n /= 2)
+  {
+    index->shift--;
+  }
+}
+
+static int stripe_of(int disk_num, int block_num)
+{
+  return (long) index_bucket(&new_index, disk_num, block_num) * SHARED_STRIPES / new_index.num_buckets;
+}
+
+// Takes the lock of a stripe of a shared cache. If its owner died in the middle of changing the chains of the
+// stripe, they are emptied: their entries stay valid but can't be found anymore, until the LRU evicts them.
+static void lock_stripe(int stripe)
+{
+  if (shared != NULL && pthread_mutex_lock(&shared->stripes[stripe]) == EOWNERDEAD)
+  {
+    int first = (stripe * new_index.num_buckets + SHARED_STRIPES - 1) / SHARED_STRIPES;
+    for (int i = first; i < new_index.num_buckets && (long) i * SHARED_STRIPES / new_index.num_buckets == stripe; i++)
+    {
+      new_index.buckets[i] = -1;
+    }
+    pthread_mutex_consistent(&shared->stripes[stripe]);
+  }
+}
+
+static void unlock_stripe(int stripe)
+{
+  if (shared != NULL)
+  {
+    pthread_mutex_unlock(&shared->stripes[stripe]);
+  }
+}
+
+static int index_alloc(cache_index_t *index, int num_entries)
+{
+  int num_buckets = index_num_buckets(num_entries);
+  index->buckets = malloc(num_buckets * sizeof(int));
+  if (index->buckets == NULL)
+  {
+    return -1;
+  }
+  index_set_size(index, num_buckets);
+  for (int i = 0; i < num_buckets; i++)
+  {
+    index->buckets[i] = -1;
+  }
+  return 1;
+}
+
+static void index_free(cache_index_t *index)
+{
+  free(index->buckets);
+  index->buckets = NULL;
+  index->num_buckets = 0;
+  index->shift = 0;
+}
+
+static void index_add(int entry)
+{
+  cache_entry_t *e = entry_at(entry);
+  int bucket = index_bucket(&new_index, e->disk_num, e->block_num);
+  e->next = new_index.buckets[bucket];
+  new_index.buckets[bucket] = entry;
+}
+
+// Returns the position of the entry in |index|, -1 if it is not there
+static int index_find_in(const cache_index_t *index, int disk_num, int block_num)
+{
+  if (index->buckets == NULL)
+  {
+    return -1;
+  }
+  for (int i = index->buckets[index_bucket(index, disk_num, block_num)]; i != -1; i = entry_at(i)->next)
+  {
+    if (entry_at(i)->disk_num == disk_num && entry_at(i)->block_num == block_num)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int index_find(int disk_num, int block_num)
+{
+  int entry = index_find_in(&new_index, disk_num, block_num);
+  return entry != -1 ? entry : index_find_in(&old_index, disk_num, block_num);
+}
+
+static bool index_remove_from(cache_index_t *index, int entry)
+{
+  if (index->buckets == NULL)
+  {
+    return false;
+  }
+  int *link = &index->buckets[index_bucket(index, entry_at(entry)->disk_num, entry_at(entry)->block_num)];
+  while (*link != -1)
+  {
+    if (*link == entry)
+    {
+      *link = entry_at(entry)->next;
+      return true;
+    }
+    link = &entry_at(*link)->next;
+  }
+  return false;
+}
+
+static void index_remove(int entry)
+{
+  if (index_remove_from(&new_index, entry) == false)
+  {
+    index_remove_from(&old_index, entry);
+  }
+}
+
+// Starts moving the entries to an index sized for the cache, if the current one is smaller. There is only room
+// for two indexes, so during a rehash this waits for index_rehash_step to call it again once the rehash is over.
+static void index_grow(void)
+{
+  cache_index_t grown;
+  if (old_index.buckets != NULL || index_num_buckets(cache_size) <= new_index.num_buckets ||
+      index_alloc(&grown, cache_size) == -1)
+  {
+    return;  // Without a bigger index the chains are just longer than we would like
+  }
+  old_index = new_index;
+  new_index = grown;
+  rehash_pos = 0;
+}
+
+// Moves a few buckets of the old index over to the new one, so a resize never rehashes everything in one call
+static void index_rehash_step(void)
+{
+  for (int n = 0; n < REHASH_STEP && old_index.buckets != NULL; n++)
+  {
+    int entry = old_index.buckets[rehash_pos];
+    while (entry != -1)
+    {
+      int next = entry_at(entry)->next;
+      index_add(entry);
+      entry = next;
+    }
+    old_index.buckets[rehash_pos] = -1;
+
+    if (++rehash_pos == old_index.num_buckets)
+    {
+      index_free(&old_index);  // Everything moved, the rehash is over
+      rehash_pos = 0;
+      index_grow();  // The cache may have grown again in the meantime
+    }
+  }
+}
+
+// Throws the index away and builds it again from the valid entries, used when entries move around in the cache
+static void index_rebuild(void)
+{
+  index_free(&old_index);
+  rehash_pos = 0;
+  for (int i = 0; i < new_index.num_buckets; i++)
+  {
+    new_index.buckets[i] = -1;
+  }
+  for (int i = 0; i < num_allocated; i++)
+  {
+    if (entry_at(i)->valid == true)
+    {
+      index_add(i);
+    }
+  }
+}
+
+static int compare_access_time(const void *a, const void *b)
+{
+  const cache_entry_t *x = a;
+  const cache_entry_t *y = b;
+  return (x->access_time > y->access_time) - (x->access_time < y->access_time);
+}
+
+static int tier2_key(int disk_num, int block_num)
+{
+  if (disk_num < 0 || disk_num >= JBOD_NUM_DISKS * JBOD_MAX_BACKENDS || block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    return -1;
+  }
+  return disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+}
+
+// Loads the snapshot file into the freshly created cache. The entries are packed at the front of the cache
+// ordered from least to most recently used, so the LRU order survives the restart.
+static void restore_snapshot(void)
+{
+  int fd = open(snapshot_file, O_RDONLY);
+  if (fd == -1)
+  {
+    return; // No snapshot yet, we just start cold
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1 || st.st_size < (off_t) sizeof(cache_snapshot_header_t))
+  {
+    close(fd);
+    return;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return;
+  }
+
+  const cache_snapshot_header_t *header = map;
+  int saved = header->num_entries;
+  int saved_clock = header->clock;
+  if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION || saved < 0 ||
+      st.st_size != (off_t) (sizeof(cache_snapshot_header_t) + saved * sizeof(cache_entry_t)))
+  {
+    munmap(map, st.st_size);
+    return; // Not a snapshot we understand, ignore it
+  }
+  if (saved == 0)
+  {
+    munmap(map, st.st_size);
+    return;
+  }
+
+  cache_entry_t *entries = malloc(saved * sizeof(cache_entry_t));
+  bool *seen = calloc(TIER2_MAX_KEYS, sizeof(bool));
+  if (entries == NULL || seen == NULL)
+  {
+    free(entries);
+    free(seen);
+    munmap(map, st.st_size);
+    return;
+  }
+  memcpy(entries, (const uint8_t *) map + sizeof(cache_snapshot_header_t), saved * sizeof(cache_entry_t));
+  munmap(map, st.st_size);
+
+  qsort(entries, saved, sizeof(cache_entry_t), compare_access_time);
+
+  // Nothing in the file is trusted: an entry whose block is out of range or already taken by a more recent entry
+  // is dropped. Going from the most recent one, at most cache_size are kept if the new cache is smaller.
+  int kept = 0;
+  for (int i = saved - 1; i >= 0; i--)
+  {
+    int key = tier2_key(entries[i].disk_num, entries[i].block_num);
+    entries[i].valid = kept < cache_size && key != -1 && seen[key] == false;
+    if (entries[i].valid == true)
+    {
+      seen[key] = true;
+      kept++;
+    }
+  }
+  if (entry_alloc(kept - 1) == -1)
+  {
+    kept = 0;  // Start cold
+  }
+  for (int i = 0, j = 0; i < saved && j < kept; i++)
+  {
+    if (entries[i].valid == true)
+    {
+      *entry_at(j++) = entries[i];
+    }
+  }
+  num_restored = kept;
+  index_rebuild();
+  access_clock = saved_clock > access_clock ? saved_clock : access_clock;
+  if (num_restored > 0 && entry_at(num_restored - 1)->access_time > access_clock)
+  {
+    access_clock = entry_at(num_restored - 1)->access_time;
+  }
+
+  free(entries);
+  free(seen);
+}
+
+
+static int tier2_open(void)
+{
+  tier2_fd = open(tier2_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  tier2_slots = malloc(tier2_size * sizeof(tier2_slot_t));
+  tier2_slot_of = malloc(TIER2_MAX_KEYS * sizeof(int));
+  if (tier2_fd == -1 || tier2_slots == NULL || tier2_slot_of == NULL ||
+      ftruncate(tier2_fd, (off_t) tier2_size * JBOD_BLOCK_SIZE) == -1)
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < tier2_size; i++)
+  {
+    tier2_slots[i].key = -1;
+    tier2_slots[i].next = i + 1 < tier2_size ? i + 1 : -1;
+  }
+  for (int i = 0; i < TIER2_MAX_KEYS; i++)
+  {
+    tier2_slot_of[i] = -1;
+  }
+  tier2_free = 0;
+  tier2_oldest = -1;
+  tier2_newest = -1;
+  return 1;
+}
+
+static void tier2_close(void)
+{
+  if (tier2_fd != -1)
+  {
+    close(tier2_fd);
+  }
+  free(tier2_slots);
+  free(tier2_slot_of);
+  tier2_fd = -1;
+  tier2_slots = NULL;
+  tier2_slot_of = NULL;
+}
+
+// Takes the block out of the file, the slot goes back to the free list
+static void tier2_drop(int key)
+{
+  int slot = tier2_slot_of[key];
+  tier2_slot_t *s = &tier2_slots[slot];
+
+  if (s->prev != -1)
+  {
+    tier2_slots[s->prev].next = s->next;
+  }
+  else
+  {
+    tier2_oldest = s->next;
+  }
+  if (s->next != -1)
+  {
+    tier2_slots[s->next].prev = s->prev;
+  }
+  else
+  {
+    tier2_newest = s->prev;
+  }
+
+  tier2_slot_of[key] = -1;
+  s->key = -1;
+  s->next = tier2_free;
+  tier2_free = slot;
+}
+
+// Forgets the copy of a block in the file, if there is one, because it is about to be out of date
+static void tier2_invalidate(int disk_num, int block_num)
+{
+  int key = tier2_key(disk_num, block_num);
+  if (tier2_fd != -1 && key != -1 && tier2_slot_of[key] != -1)
+  {
+    tier2_drop(key);
+  }
+}
+
+// Writes a block evicted from memory to the file, making room by dropping the oldest demoted block if needed
+static void tier2_demote(const cache_entry_t *entry)
+{
+  int key = tier2_key(entry->disk_num, entry->block_num);
+  if (tier2_fd == -1 || key == -1)
+  {
+    return;
+  }
+  if (tier2_slot_of[key] != -1)
+  {
+    tier2_drop(key);
+  }
+  if (tier2_free == -1)
+  {
+    tier2_drop(tier2_slots[tier2_oldest].key);
+  }
+
+  int slot = tier2_free;
+  if (pwrite(tier2_fd, entry->block, JBOD_BLOCK_SIZE, (off_t) slot * JBOD_BLOCK_SIZE) != JBOD_BLOCK_SIZE)
+  {
+    return;  // The block is simply not kept, the device still has it
+  }
+  tier2_free = tier2_slots[slot].next;
+  tier2_slots[slot].key = key;
+  tier2_slots[slot].prev = tier2_newest;
+  tier2_slots[slot].next = -1;
+  if (tier2_newest != -1)
+  {
+    tier2_slots[tier2_newest].next = slot;
+  }
+  else
+  {
+    tier2_oldest = slot;
+  }
+  tier2_newest = slot;
+  tier2_slot_of[key] = slot;
+  tier2_demoted++;
+}
+
+// Reads a block from the file. When |promote| is true the block leaves the file, the caller moves it to memory.
+static int tier2_read(int disk_num, int block_num, uint8_t *buf, bool promote)
+{
+  int key = tier2_key(disk_num, block_num);
+  if (tier2_fd == -1 || key == -1 || tier2_slot_of[key] == -1)
+  {
+    return -1;
+  }
+  if (pread(tier2_fd, buf, JBOD_BLOCK_SIZE, (off_t) tier2_slot_of[key] * JBOD_BLOCK_SIZE) != JBOD_BLOCK_SIZE)
+  {
+    tier2_drop(key);
+    return -1;
+  }
+  if (promote == true)
+  {
+    tier2_drop(key);
+  }
+  return 1;
+}
+
+// Makes the shadow LRU hold what the cache holds, e.g. once a snapshot was restored into it
+static void shadow_seed(void)
+{
+  shadow_used = 0;
+  for (int i = 0; i < num_allocated && shadow != NULL && entry_at(i)->valid == true; i++)
+  {
+    shadow[shadow_used].key = entry_at(i)->disk_num * JBOD_NUM_BLOCKS_PER_DISK + entry_at(i)->block_num;
+    shadow[shadow_used++].access_time = entry_at(i)->access_time;
+  }
+  shadow_clock = access_clock;
+}
+
+// Evicts one block while a shrink left more than fit, at the same pace as shrink_step does in the cache
+static void shadow_shrink_step(void)
+{
+  if (shadow == NULL || shadow_used <= cache_size)
+  {
+    return;
+  }
+  int victim = 0;
+  for (int i = 1; i < shadow_used; i++)
+  {
+    if (shadow[i].access_time < shadow[victim].access_time)
+    {
+      victim = i;
+    }
+  }
+  shadow[victim] = shadow[--shadow_used];
+}
+
+// Returns true if the block is in the shadow LRU and makes it the most recently used. If it is not and |insert|
+// is true it takes a free slot, or the place of the least recently used block once there is none.
+static bool shadow_access(int disk_num, int block_num, bool insert)
+{
+  if (shadow == NULL)
+  {
+    return false;
+  }
+  int key = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+  int victim = 0;
+  for (int i = 0; i < shadow_used; i++)
+  {
+    if (shadow[i].key == key)
+    {
+      shadow[i].access_time = ++shadow_clock;
+      return true;
+    }
+    if (shadow[i].access_time < shadow[victim].access_time)
+    {
+      victim = i;
+    }
+  }
+  if (insert == true)
+  {
+    victim = shadow_used < cache_size ? shadow_used++ : victim;
+    shadow[victim].key = key;
+    shadow[victim].access_time = ++shadow_clock;
+  }
+  return false;
+}
+
+static void admission_free(void)
+{
+  free(sketch);
+  free(in_window);
+  free(shadow);
+  sketch = NULL;
+  in_window = NULL;
+  shadow = NULL;
+  window_count = 0;
+  shadow_used = 0;
+}
+
+static int admission_alloc(int num_entries)
+{
+  free(sketch);
+  free(in_window);
+  window_count = 0;
+  in_window = calloc(CACHE_MAX_ENTRIES, sizeof(bool));  // Entries past cache_size stay around during a shrink
+  sketch_width = 1;
+  sketch_shift = 32;
+  while (sketch_width < 2 * num_entries)
+  {
+    sketch_width *= 2;
+    sketch_shift--;
+  }
+  sketch = calloc(SKETCH_DEPTH * sketch_width, sizeof(uint8_t));
+  sketch_accesses = 0;
+  if (shadow == NULL)
+  {
+    shadow = malloc(CACHE_MAX_ENTRIES * sizeof(shadow_entry_t));  // It keeps its blocks across a resize
+  }
+  return sketch != NULL && in_window != NULL && shadow != NULL ? 1 : -1;
+}
+
+// The top bits of a multiplicative hash, the low ones would put a block in the same column of every row
+static uint8_t *sketch_counter(int row, int disk_num, int block_num)
+{
+  uint32_t key = (uint32_t) disk_num * JBOD_NUM_BLOCKS_PER_DISK + (uint32_t) block_num;
+  return &sketch[row * sketch_width + ((key * sketch_seeds[row]) >> sketch_shift)];
+}
+
+static void sketch_add(int disk_num, int block_num)
+{
+  if (sketch == NULL)
+  {
+    return;
+  }
+  for (int row = 0; row < SKETCH_DEPTH; row++)
+  {
+    uint8_t *counter = sketch_counter(row, disk_num, block_num);
+    *counter += *counter < SKETCH_MAX_COUNT;
+  }
+  if (++sketch_accesses >= SKETCH_SAMPLE * cache_size)
+  {
+    for (int i = 0; i < SKETCH_DEPTH * sketch_width; i++)
+    {
+      sketch[i] /= 2;  // Aging, what was popular a long time ago fades out
+    }
+    sketch_accesses /= 2;
+  }
+}
+
+static int sketch_estimate(int entry)
+{
+  int estimate = SKETCH_MAX_COUNT;
+  for (int row = 0; row < SKETCH_DEPTH; row++)
+  {
+    uint8_t count = *sketch_counter(row, entry_at(entry)->disk_num, entry_at(entry)->block_num);
+    estimate = count < estimate ? count : estimate;
+  }
+  return estimate;
+}
+
+// Picks the entry a missed block replaces in a full cache, the block then takes its place in the window. Until the
+// window is full that is the least recently used entry outside of it. After that the least recently used entry of
+// the window moves out of it if it was used more often than that entry, and is replaced itself otherwise.
+static int window_victim(int used)
+{
+  int window_lru = -1;
+  int main_lru = -1;
+  for (int i = 0; i < used; i++)
+  {
+    int *lru = in_window[i] == true ? &window_lru : &main_lru;
+    if (*lru == -1 || entry_at(i)->access_time < entry_at(*lru)->access_time)
+    {
+      *lru = i;
+    }
+  }
+
+  int victim = main_lru;
+  // A missed block faces the admission test once it is the least recently used of a full window. In a window of
+  // one entry that is at the very next miss, before it can be used again, so blocks reused a few accesses later
+  // (linear reads) were all turned away.
+  int window_min = WINDOW_MIN < cache_size - 1 ? WINDOW_MIN : cache_size - 1;
+  int window_size = cache_size * WINDOW_PERCENT / 100 > window_min ? cache_size * WINDOW_PERCENT / 100 : window_min;
+  if (window_count >= window_size)
+  {
+    admission_candidates++;
+    if (sketch_estimate(window_lru) > sketch_estimate(main_lru))
+    {
+      admission_admitted++;
+      in_window[window_lru] = false;
+      window_count--;
+    }
+    else
+    {
+      victim = window_lru;  // Not used more often than what it would replace, e.g. part of a scan
+      window_count--;
+    }
+  }
+  in_window[victim] = true;
+  window_count++;
+  return victim;
+}
+
+// Moves entry |from| to the free slot |to|, leaving |from| free
+static void entry_move(int from, int to)
+{
+  if (from == to)
+  {
+    return;
+  }
+  index_remove(from);
+  *entry_at(to) = *entry_at(from);
+  entry_at(from)->valid = false;
+  index_add(to);
+  if (in_window != NULL)
+  {
+    in_window[to] = in_window[from];
+    in_window[from] = false;
+  }
+}
+
+// Evicts the least recently used entry while a shrink left more entries than fit, so a resize never evicts them
+// all in one call. The freed slot is filled from the end to keep the entries packed, and the restored entries
+// stay in front of the others. Once nothing is past the end of the cache, the chunks there are released.
+static void shrink_step(void)
+{
+  int used = count_valid();
+  if (used <= cache_size)
+  {
+    while (shared == NULL && num_allocated - CHUNK_ENTRIES >= cache_size)
+    {
+      num_allocated -= CHUNK_ENTRIES;
+      free(chunks[num_allocated / CHUNK_ENTRIES]);
+      chunks[num_allocated / CHUNK_ENTRIES] = NULL;
+    }
+    return;
+  }
+
+  int victim = lru_entry(used);
+  tier2_demote(entry_at(victim));
+  index_remove(victim);
+  entry_at(victim)->valid = false;
+  if (in_window != NULL && in_window[victim] == true)
+  {
+    in_window[victim] = false;
+    window_count--;
+  }
+  if (victim < num_restored)
+  {
+    entry_move(--num_restored, victim);
+    victim = num_restored;
+  }
+  entry_move(used - 1, victim);
+}
+
+// Drops everything a private cache holds, including its second tier
+static void cache_clear(void)
+{
+  for (int i = 0; i < num_allocated / CHUNK_ENTRIES; i++)
+  {
+    free(chunks[i]);
+    chunks[i] = NULL;
+  }
+  num_allocated = 0;
+  num_restored = 0;
+  index_free(&old_index);
+  rehash_pos = 0;
+  for (int i = 0; i < new_index.num_buckets; i++)
+  {
+    new_index.buckets[i] = -1;
+  }
+  shadow_used = 0;
+  if (tier2_fd != -1)
+  {
+    tier2_close();
+    if (tier2_open() == -1)
+    {
+      tier2_close();
+    }
+  }
+}
+
+// The work a resize leaves to the following cache operations, a few steps of it per operation
+static void resize_step(void)
+{
+  if (shared != NULL)
+  {
+    return;  // A shared cache is never resized, and lookups don't hold what this would need
+  }
+  index_rehash_step();
+  shrink_step();
+  shadow_shrink_step();
+}
+
+// Waits up to SHARED_WAIT_MS for |ready| to return true
+static bool shared_wait(bool (*ready)(int fd, cache_shared_header_t *header), int fd, cache_shared_header_t *header)
+{
+  for (int waited = 0; ready(fd, header) == false; waited++)
+  {
+    if (waited == SHARED_WAIT_MS)
+    {
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+static bool shared_sized(int fd, cache_shared_header_t *header)
+{
+  struct stat st;
+  return fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(cache_shared_header_t);
+}
+
+static bool shared_ready(int fd, cache_shared_header_t *header)
+{
+  return __atomic_load_n(&header->ready, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Maps the segment, creating and initializing it if no other process has it. Sets |abandoned| if the segment
+// exists but its creator never finished setting it up, e.g. because it was killed in the middle.
+static cache_shared_header_t *shared_map(int num_entries, int num_buckets, size_t *size, bool *abandoned)
+{
+  *abandoned = false;
+  bool creator = true;
+  int fd = shm_open(shared_name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd == -1 && errno == EEXIST)
+  {
+    creator = false;
+    fd = shm_open(shared_name, O_RDWR, 0);
+  }
+  if (fd == -1)
+  {
+    return NULL;
+  }
+
+  struct stat st;
+  *size = sizeof(cache_shared_header_t) + num_buckets * sizeof(int) + num_entries * sizeof(cache_entry_t);
+  if (creator == true && ftruncate(fd, *size) == -1)
+  {
+    close(fd);
+    shm_unlink(shared_name);
+    return NULL;
+  }
+  if (creator == false)
+  {
+    // The creator sizes the segment right after creating it, which may not have happened yet
+    *abandoned = shared_wait(shared_sized, fd, NULL) == false;
+    if (*abandoned == true || fstat(fd, &st) == -1)
+    {
+      close(fd);
+      return NULL;
+    }
+    *size = st.st_size;
+  }
+
+  cache_shared_header_t *header = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED)
+  {
+    close(fd);
+    return NULL;
+  }
+
+  if (creator == true)
+  {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&header->lock, &attr);
+    for (int i = 0; i < SHARED_STRIPES; i++)
+    {
+      pthread_mutex_init(&header->stripes[i], &attr);
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    header->magic = SHARED_MAGIC;
+    header->num_entries = num_entries;
+    header->num_buckets = num_buckets;
+    memset(header->users, 0, sizeof(header->users));
+    shared_clear(header);
+    __atomic_store_n(&header->ready, 1, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    *abandoned = shared_wait(shared_ready, fd, header) == false;
+    if (*abandoned == true || header->magic != SHARED_MAGIC ||
+        *size < sizeof(cache_shared_header_t) + header->num_buckets * sizeof(int) +
+                header->num_entries * sizeof(cache_entry_t))
+    {
+      close(fd);
+      munmap(header, *size);
+      return NULL;
+    }
+  }
+  close(fd);
+  return header;
+}
+
+// Forgets the processes that exited without calling cache_destroy (errx, a crash...) and returns how many are left.
+// Called with the lock held.
+static int shared_prune_users(void)
+{
+  int alive = 0;
+  for (int i = 0; i < SHARED_MAX_USERS; i++)
+  {
+    if (shared->users[i] != 0 && kill(shared->users[i], 0) == -1 && errno == ESRCH)
+    {
+      shared->users[i] = 0;
+    }
+    alive += shared->users[i] != 0;
+  }
+  return alive;
+}
+
+// Maps the shared cache. A process that attaches to an existing segment gets the size its creator chose, all of
+// them share that memory budget.
+static int shared_attach(int num_entries)
+{
+  int num_buckets = index_num_buckets(num_entries);
+  size_t size;
+  bool abandoned;
+  cache_shared_header_t *header = shared_map(num_entries, num_buckets, &size, &abandoned);
+  if (header == NULL && abandoned == true)
+  {
+    shm_unlink(shared_name);  // Nobody will ever finish it, start over with a segment of our own
+    header = shared_map(num_entries, num_buckets, &size, &abandoned);
+  }
+  if (header == NULL)
+  {
+    return -1;
+  }
+
+  shared = header;
+  lock_cache();
+  if (shared_prune_users() == 0)
+  {
+    // Left behind by processes that are all gone. The JBOD may have been mounted (and zeroed) since they cached
+    // these blocks, so none of them can be trusted.
+    shared_clear(header);
+  }
+  int slot = 0;
+  while (slot < SHARED_MAX_USERS && header->users[slot] != 0)
+  {
+    slot++;
+  }
+  if (slot < SHARED_MAX_USERS)
+  {
+    header->users[slot] = getpid();
+  }
+  unlock_cache();
+  if (slot == SHARED_MAX_USERS)
+  {
+    shared = NULL;
+    munmap(header, size);
+    return -1;
+  }
+
+  shared_size = size;
+  new_index.buckets = (int *) (header + 1);
+  index_set_size(&new_index, header->num_buckets);
+  cache_entry_t *entries = (cache_entry_t *) (new_index.buckets + header->num_buckets);
+  cache_size = header->num_entries;
+  for (num_allocated = 0; num_allocated < cache_size; num_allocated += CHUNK_ENTRIES)
+  {
+    chunks[num_allocated / CHUNK_ENTRIES] = entries + num_allocated;
+  }
+  num_allocated = cache_size;  // The last chunk may be shorter, the segment ends there
+  return 1;
+}
+
+static void shared_detach(void)
+{
+  lock_cache();
+  for (int i = 0; i < SHARED_MAX_USERS; i++)
+  {
+    if (shared->users[i] == getpid())
+    {
+      shared->users[i] = 0;
+    }
+  }
+  if (shared_prune_users() == 0)
+  {
+    shm_unlink(shared_name);  // Processes still mapping it keep it until they unmap it
+  }
+  unlock_cache();
+  munmap(shared, shared_size);
+  shared = NULL;
+  memset(chunks, 0, sizeof(chunks));
+  num_allocated = 0;
+  cache_size = 0;
+  new_index.buckets = NULL;
+  new_index.num_buckets = 0;
+}
 
 // Create and Destroy is similar as unmount and mount in mdadm.c. 
 int cache_create(int num_entries) {
-  if (num_entries < 2 || num_entries > 4096 || cache != NULL)
+  if (num_entries < 2 || num_entries > CACHE_MAX_ENTRIES || cache_size != 0)
   {
     return -1; // Making Sure for improper parameters and make sure that there isn't two cache creates in a row.
   }
 
-  cache = malloc(num_entries * sizeof(cache_entry_t)); // dynamically allocate space for num_entries cache entries
-  cache_size = num_entries; // Cache size is fixed. 
+  num_restored = 0;
+  if (shared_name != NULL)
+  {
+    return shared_attach(num_entries);  // No second tier nor snapshot, they are private to a process
+  }
+
+  if (index_alloc(&new_index, num_entries) == -1)  // The entries themselves are allocated as they fill up
+  {
+    return -1;
+  }
+  cache_size = num_entries; // Cache size only changes through cache_resize.
+
+  if (tier2_file != NULL && tier2_open() == -1)
+  {
+    tier2_close();  // The cache works without its second tier
+  }
+  if (admission == true && admission_alloc(num_entries) == -1)
+  {
+    admission_free();  // Nor does it need the admission filter
+  }
 
-  for(int i = 0; i < cache_size; i++)
+  if (snapshot_file != NULL)
   {
-    cache[i].valid = false;
+    restore_snapshot(); // Warm restart from the last saved cache contents
+    shadow_seed();
   }
 
   return 1; // Successful Cache create
 }
 
 int cache_destroy(void) {
-  if (cache == NULL)
+  if (cache_size == 0)
   {
     return -1; // Can't destory cache that doesn't exist.
   }
-  free(cache);
-  cache = NULL;
+  admission_free();
+  if (shared != NULL)
+  {
+    shared_detach();
+    return 1;
+  }
+  if (snapshot_file != NULL)
+  {
+    cache_save_snapshot();
+  }
+  tier2_close();
+  cache_clear();
   cache_size = 0;
+  index_free(&new_index);
+  index_free(&old_index);
+  rehash_pos = 0;
 
   return 1; // Successful Cache Destory
 }
@@ -49,109 +1226,367 @@ int cache_destroy(void) {
 // We need to check if the data we are seeking is already in the cache and no need to got the main memory
 int cache_lookup(int disk_num, int block_num, uint8_t *buf) {
 
-  if( cache == NULL || buf == NULL || cache[0].valid == false)
+  if( cache_size == 0 || buf == NULL)
   {
-    return -1; // Making sure we are having an existing cache, a non-NULL buf, and not an empty cache
+    return -1; // Making sure we are having an existing cache and a non-NULL buf
+  }
+
+  int stripe = stripe_of(disk_num, block_num);
+  lock_stripe(stripe);
+  if (entry_valid(0) == false)
+  {
+    unlock_stripe(stripe);
+    return -1; // Nothing is counted while the cache is empty
   }
 
   num_queries++; // We must increment every time we call a lookup
-  for(int i = 0; i < cache_size; i++)
+  resize_step();
+
+  // Checking if we have the disk and block that we want in the cache already
+  int i = index_find(disk_num, block_num);
+  // A miss of both is inserted by the caller later, a block only the shadow LRU misses has to be inserted now
+  shadow_hits += shadow_access(disk_num, block_num, i != -1);
+  if(i != -1)
   {
-    // Checking if we have the disk and block that we want in the cache already
-    if(cache[i].valid == true && cache[i].disk_num == disk_num && cache[i].block_num == block_num)
+    num_hits++; // We found it in the cache so it is a HIT
+    make_recent(i);
+    sketch_add(disk_num, block_num);
+    memcpy(buf, entry_at(i)->block, JBOD_BLOCK_SIZE);
+    unlock_stripe(stripe);
+    return 1; // Successful lookup
+  }
+  unlock_stripe(stripe);
+
+  // Not in memory, but it may have been demoted to the second tier, in which case it moves back to memory
+  if (tier2_fd != -1)
+  {
+    tier2_queries++;
+    if (tier2_read(disk_num, block_num, buf, true) == 1)
     {
-      num_hits++; // We found it in the cache so it is a HIT
-      clock++;
-      cache[i].access_time = clock;
-      memcpy(buf,cache[i].block, JBOD_BLOCK_SIZE);
-      return 1; // Successful lookup
+      tier2_hits++;
+      cache_insert(disk_num, block_num, buf);
+      return 1;
     }
   }
   return -1; // Did not find it in the cache
 
   
 
+}
+
+static void update_locked(int disk_num, int block_num, const uint8_t *buf) {
+
+  shadow_access(disk_num, block_num, false);
+  int i = index_find(disk_num, block_num);
+  if(i != -1)
+  {
+    memcpy(entry_at(i)->block, buf, JBOD_BLOCK_SIZE);  // Finding the disk and block wihin the cache and updating it with the new buf
+    make_recent(i);
+  }
+  else
+  {
+    tier2_invalidate(disk_num, block_num);
+  }
+
 }
 
 // Updates the blocks content with the new data in buf
 void cache_update(int disk_num, int block_num, const uint8_t *buf) {
 
-  for(int i = 0; i < cache_size; i++)
+  if (cache_size == 0)
   {
-    if(cache[i].disk_num == disk_num && cache[i].block_num == block_num)
-    {
-      memcpy(cache[i].block, buf, JBOD_BLOCK_SIZE);  // Finding the disk and block wihin the cache and updating it with the new buf
-      cache[i].valid = true;
-      clock++;
-      cache[i].access_time = clock;
-    } 
+    return;
   }
-  
+
+  int stripe = stripe_of(disk_num, block_num);
+  lock_stripe(stripe);
+  update_locked(disk_num, block_num, buf);
+  unlock_stripe(stripe);
 }
 
-// If the cache doesn't have the memory we are looking for we add it to the cache
-int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
-  if (cache_size == 0 || buf == NULL || disk_num < 0 || disk_num > 16 || block_num < 0 || block_num > 256)
+// Refreshes the recency of a block without it being counted as an access
+void cache_touch(int disk_num, int block_num) {
+
+  if (cache_size == 0)
   {
-    return -1; // Ensuring that we have an existing cache and that the buff is not the NULL and the disk & block num are valid
+    return;
   }
 
-  for(int i = 0; i < cache_size; i++) // If disk_num and block_nim exists already in the cache we want to update it with the new content
+  int stripe = stripe_of(disk_num, block_num);
+  lock_stripe(stripe);
+  shadow_access(disk_num, block_num, false);
+  int i = index_find(disk_num, block_num);
+  if(i != -1)
   {
-    if(cache[i].valid != false && cache[i].disk_num == disk_num && cache[i].block_num == block_num)
-    {
-      cache_update(disk_num,block_num,buf);
-      return -1;
-    }
+    make_recent(i);
+  }
+  unlock_stripe(stripe);
+}
+
+// Looks at a block without it being counted as an access, used by the scrubber
+int cache_peek(int disk_num, int block_num, uint8_t *buf) {
+
+  if( cache_size == 0 || buf == NULL)
+  {
+    return -1;
+  }
+
+  int stripe = stripe_of(disk_num, block_num);
+  lock_stripe(stripe);
+  int i = index_find(disk_num, block_num);
+  if(i != -1)
+  {
+    memcpy(buf, entry_at(i)->block, JBOD_BLOCK_SIZE);
+    unlock_stripe(stripe);
+    return 1;
+  }
+  unlock_stripe(stripe);
+  return tier2_read(disk_num, block_num, buf, false);
+}
+
+// Called with the cache's lock held, so no other insert changes the chains meanwhile. The stripes are only taken
+// around the changes, to keep lookups of the same stripes from seeing them half done.
+static int insert_locked(int disk_num, int block_num, const uint8_t *buf) {
+
+  resize_step();
+  sketch_add(disk_num, block_num);
+  shadow_access(disk_num, block_num, true);
+  int stripe = stripe_of(disk_num, block_num);
+  if(index_find(disk_num, block_num) != -1) // If disk_num and block_nim exists already in the cache we want to update it with the new content
+  {
+    lock_stripe(stripe);
+    update_locked(disk_num,block_num,buf);
+    unlock_stripe(stripe);
+    return -1;
   }
+  tier2_invalidate(disk_num, block_num);  // The new contents supersede whatever was demoted
 
   // If it doesn't exist we add it at the at the end if there is still space
-  if(cache[cache_size-1].valid == false)
+  int used = count_valid();
+  if(used < cache_size && entry_alloc(used) == 1)
   {
-    for(int i = 0; i < cache_size; i++)
-    {
-      if(cache[i].valid == false)
-      {
-        clock++;
-        cache[i].disk_num = disk_num;
-        cache[i].block_num = block_num;
-        cache[i].valid = true;
-        cache[i].access_time = clock;
-        memcpy(cache[i].block,buf, JBOD_BLOCK_SIZE);
-        return 1;
-      }
-    }
-  
+    cache_entry_t *entry = entry_at(used);
+    entry->disk_num = disk_num;
+    entry->block_num = block_num;
+    entry->valid = true;
+    make_recent(used);
+    memcpy(entry->block,buf, JBOD_BLOCK_SIZE);
+    lock_stripe(stripe);
+    index_add(used);
+    unlock_stripe(stripe);
+    return 1;
+  }
+  if (used == 0)
+  {
+    return -1;  // No memory for the first chunk
   }
 
   // If there is no space left in the cache we apply the LRU policy  (similar of finding the min number in a list functionality )
+  int LRU_index = sketch == NULL ? lru_entry(used) : window_victim(used);  // With the admission filter on, the window decides instead
 
-  int LRU = cache[0].access_time; // We need to find the least recently used cache line
-  int LRU_index = 0; // we need to do where this LRU cache line is in the cache
-  
-  for (int i = 0; i < cache_size; i++)
+  // Once we located the LRU we will overwrite the data with the new data we want
+  cache_entry_t *entry = entry_at(LRU_index);
+  int victim_stripe = stripe_of(entry->disk_num, entry->block_num);
+  lock_stripe(victim_stripe < stripe ? victim_stripe : stripe);  // Always in the same order, lowest first
+  if (victim_stripe != stripe)
   {
-    if(cache[i].access_time < LRU)
-    {
-      LRU = cache[i].access_time;
-      LRU_index = i;
-    }
+    lock_stripe(victim_stripe < stripe ? stripe : victim_stripe);
+  }
+  tier2_demote(entry);
+  index_remove(LRU_index);
+  entry->disk_num = disk_num;
+  entry->block_num = block_num;
+  entry->valid = true;
+  memcpy(entry->block, buf, JBOD_BLOCK_SIZE);
+  make_recent(LRU_index);
+  index_add(LRU_index);
+  unlock_stripe(stripe);
+  if (victim_stripe != stripe)
+  {
+    unlock_stripe(victim_stripe);
+  }
+
+  return 1;
+}
+
+// If the cache doesn't have the memory we are looking for we add it to the cache
+int cache_insert(int disk_num, int block_num, const uint8_t *buf) {
+  if (cache_size == 0 || buf == NULL || disk_num < 0 || disk_num >= JBOD_NUM_DISKS * JBOD_MAX_BACKENDS || block_num < 0 || block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    return -1; // Ensuring that we have an existing cache and that the buff is not the NULL and the disk & block num are valid
+  }
+
+  lock_cache();
+  int rc = insert_locked(disk_num, block_num, buf);
+  unlock_cache();
+  return rc;
+}
+
+// Grows or shrinks the cache keeping its contents. Both only set the new size: the following cache operations
+// evict what no longer fits and move the entries to a bigger index a few at a time, and inserts allocate the
+// entries of a bigger cache as it fills up.
+int cache_resize(int num_entries) {
+  if (cache_size == 0 || shared != NULL || num_entries < 2 || num_entries > CACHE_MAX_ENTRIES)
+  {
+    return -1;  // A shared segment is mapped by other processes at its size
+  }
+  if (num_entries == cache_size)
+  {
+    return 1;
+  }
+  if (sketch != NULL && admission_alloc(num_entries) == -1)
+  {
+    admission_free();  // The sketch is sized for the cache, so the filter starts over at the new size
   }
-  // Once we located the LRU we will overwrite the data with the new data we want
-  cache[LRU_index].disk_num = disk_num;
-  cache[LRU_index].block_num = block_num;
-  cache[LRU_index].valid = true;
-  memcpy(cache[LRU_index].block, buf, JBOD_BLOCK_SIZE);
-  clock++;
-  cache[LRU_index].access_time = clock;
 
+  cache_size = num_entries;
+  if (cache_enabled() == false)
+  {
+    cache_clear();  // mdadm stops going through the cache, so what it holds would go stale
+  }
+  index_grow();
   return 1;
 }
 // Returns true if the cache is proper and able to be used
 bool cache_enabled(void) {
-  return cache_size > 2 && cache != NULL;
+  return cache_size > 2;
 }
 
 void cache_print_hit_rate(void) {
   fprintf(stderr, "Hit rate: %5.1f%%\n", 100 * (float) num_hits / num_queries);
-}
\ No newline at end of file
+  if (tier2_file != NULL)
+  {
+    fprintf(stderr, "Tier 2 hit rate: %5.1f%% (%d demoted, %d promoted)\n",
+            100 * (float) tier2_hits / tier2_queries, tier2_demoted, tier2_hits);
+  }
+  if (admission_candidates > 0)
+  {
+    fprintf(stderr, "Admission rate: %5.1f%% (%d of %d blocks leaving the window admitted)\n",
+            100 * (float) admission_admitted / admission_candidates, admission_admitted, admission_candidates);
+    fprintf(stderr, "LRU hit rate: %5.1f%% without the admission filter (%+.1f points with it)\n",
+            100 * (float) shadow_hits / num_queries, 100 * (float) (num_hits - shadow_hits) / num_queries);
+  }
+}
+
+int cache_set_admission(bool enabled) {
+  if (cache_size != 0)
+  {
+    return -1; // The sketch is sized in cache_create, so it has to be set before that
+  }
+  admission = enabled;
+  return 1;
+}
+
+int cache_set_tier2(const char *path, int num_blocks) {
+  if (cache_size != 0 || (path != NULL && (num_blocks < 1 || num_blocks > TIER2_MAX_KEYS)))
+  {
+    return -1; // The file is opened in cache_create, so it has to be set before that
+  }
+  free(tier2_file);
+  tier2_file = path != NULL ? strdup(path) : NULL;
+  tier2_size = num_blocks;
+  return 1;
+}
+
+int cache_set_shared(const char *name) {
+  if (cache_size != 0)
+  {
+    return -1; // The segment is mapped in cache_create, so it has to be set before that
+  }
+  free(shared_name);
+  shared_name = name != NULL ? strdup(name) : NULL;
+  return 1;
+}
+
+int cache_set_snapshot_file(const char *path) {
+  if (cache_size != 0)
+  {
+    return -1; // The snapshot is read in cache_create, so it has to be set before that
+  }
+  free(snapshot_file);
+  snapshot_file = path != NULL ? strdup(path) : NULL;
+  return 1;
+}
+
+// Saves the valid entries with their access times so the next cache_create can rebuild the same LRU order
+int cache_save_snapshot(void) {
+  if (cache_size == 0 || shared != NULL || snapshot_file == NULL)
+  {
+    return -1;
+  }
+
+  int valid_entries = count_valid();
+
+  size_t map_size = sizeof(cache_snapshot_header_t) + valid_entries * sizeof(cache_entry_t);
+  int fd = open(snapshot_file, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+  {
+    return -1;
+  }
+  if (ftruncate(fd, map_size) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return -1;
+  }
+
+  cache_snapshot_header_t *header = map;
+  header->magic = SNAPSHOT_MAGIC;
+  header->version = SNAPSHOT_VERSION;
+  header->num_entries = valid_entries;
+  header->clock = access_clock;
+
+  cache_entry_t *entries = (cache_entry_t *) ((uint8_t *) map + sizeof(cache_snapshot_header_t));
+  for (int i = 0; i < valid_entries; i++)
+  {
+    entries[i] = *entry_at(i);
+  }
+
+  int rc = msync(map, map_size, MS_SYNC) == 0 ? 1 : -1;
+  munmap(map, map_size);
+  return rc;
+}
+
+int cache_num_restored(void) {
+  return num_restored;
+}
+
+int cache_get_restored(int index, int *disk_num, int *block_num, uint8_t *buf) {
+  if (index < 0 || index >= num_restored || entry_valid(index) == false)
+  {
+    return -1;
+  }
+  *disk_num = entry_at(index)->disk_num;
+  *block_num = entry_at(index)->block_num;
+  if (buf != NULL)
+  {
+    memcpy(buf, entry_at(index)->block, JBOD_BLOCK_SIZE);
+  }
+  return 1;
+}
+
+void cache_finish_restore(bool keep) {
+  if (cache_size != 0 && keep == false)
+  {
+    // Drop the restored entries and slide whatever came after them to the front, the insert path expects
+    // the valid entries to be packed at the start of the cache.
+    int used = count_valid();
+    for (int i = num_restored; i < used; i++)
+    {
+      *entry_at(i - num_restored) = *entry_at(i);
+    }
+    for (int i = used - num_restored; i < used; i++)
+    {
+      entry_at(i)->valid = false;
+    }
+    index_rebuild();
+    shadow_seed();
+  }
+  num_restored = 0;
+}
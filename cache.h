@@ -13,6 +13,7 @@ typedef struct {
   int block_num;
   uint8_t block[JBOD_BLOCK_SIZE];
   int access_time;
+  int next;  // Next entry in the same bucket of the cache index
 } cache_entry_t;
 
 /* Returns 1 on success and -1 on failure. Should allocate a space for
@@ -33,15 +34,100 @@ int cache_lookup(int disk_num, int block_num, uint8_t *buf);
  * |block_num| into cache. If there is already an existing entry in the cache
  * with |disk_num| and |block_num|, should update its value with data provided
  * in |buf|, which cannot be NULL. If there cache is full, should evict least
- * recently used entry and insert the new entry. */
+ * recently used entry and insert the new entry (see cache_set_admission for
+ * how the admission filter picks the entry instead). */
 int cache_insert(int disk_num, int block_num, const uint8_t *buf);
 
 void cache_update(int disk_num, int block_num, const uint8_t *buf);
 
+/* Makes |disk_num| and |block_num| the most recently used entry, if it is in
+ * the cache, without counting an access. */
+void cache_touch(int disk_num, int block_num);
+
+/* Returns 1 on success and -1 on failure. Changes the number of entries to
+ * |num_entries| without losing the contents of the cache. The call itself only
+ * records the new size (and sets up the buckets of a bigger index), the rest
+ * is spread over the following cache operations: each one evicts at most one
+ * least recently used entry that no longer fits and moves a few buckets to the
+ * bigger index. The entries are allocated in chunks as the cache fills up, so
+ * growing never copies them. */
+int cache_resize(int num_entries);
+
+/* Returns 1 and copies the block to |buf| if |disk_num| and |block_num| are in
+ * the cache, -1 otherwise. Unlike cache_lookup it does not count towards the hit
+ * rate nor change the recency of the entry. */
+int cache_peek(int disk_num, int block_num, uint8_t *buf);
+
 /* Returns true if cache is enabled and false if not. */
 bool cache_enabled(void);
 
-/* Prints the hit rate of the cache. */
+/* Prints the hit rate of the cache, of the second tier if there is one, and
+ * how many missed blocks the admission filter let in. With the filter on, the
+ * same accesses are also run through a plain LRU cache of the same size that
+ * only keeps the keys, and its hit rate is printed next to the cache's. The
+ * counts are kept per process, also with a shared cache: the rate printed is
+ * the one of the lookups of the calling process, not of every process. */
 void cache_print_hit_rate(void);
 
+/* Returns 1 on success and -1 on failure. Turns on the W-TinyLFU admission
+ * filter, so one-touch blocks of a scan don't push hot ones out. Lookup hits
+ * and inserts are counted in a small count-min sketch that is halved every
+ * 10 * cache size accesses. Blocks inserted into a full cache go to a window
+ * of 1% of the entries (at least 8, or all but one of a smaller cache), and
+ * the least recently used block of the window only stays cached if it was
+ * used more often than the least recently used entry outside of it. The
+ * shadow LRU that cache_print_hit_rate compares against is scanned on every
+ * access, a second O(n) scan next to the one of an insert, so this about
+ * doubles the cost of an access (more for a hit, which is otherwise a hash
+ * lookup). Must be called before cache_create, a shared cache (see
+ * cache_set_shared) does not use it. */
+int cache_set_admission(bool enabled);
+
+/* Returns 1 on success and -1 on failure. Adds a second tier of |num_blocks|
+ * blocks kept in the file at |path| (e.g. on a local SSD), read and written
+ * with pread/pwrite. Entries evicted from memory are demoted to it and a
+ * lookup that misses in memory but finds the block in the file promotes it
+ * back. Must be called before cache_create; NULL turns the tier off. */
+int cache_set_tier2(const char *path, int num_blocks);
+
+/* Returns 1 on success and -1 on failure. Keeps the cache in the POSIX shared
+ * memory segment |name| (e.g. "/jbod-cache") so that every process using the
+ * same name shares its entries. The first process creates the segment with
+ * the size given to cache_create, later ones use its existing size, and the
+ * last one to call cache_destroy removes it. The segment records the PIDs of
+ * the processes attached to it. A process that exits without cache_destroy
+ * (a crash, errx...) leaves the segment behind, and the next process to
+ * attach empties it if none of those PIDs is alive anymore, since the JBOD
+ * may have been remounted since. A reused PID can make a stale segment look
+ * alive. Lookups only lock the range of buckets their block falls in, so
+ * processes mostly don't wait for each other; inserts still run one at a
+ * time. A process that dies while holding one of these locks does not block
+ * the others: the next one to take it empties the chains of that range, which
+ * may have been left half changed, and the entries in them are left for the
+ * LRU to evict. A shared cache has no second tier, snapshot or resize. Must
+ * be called before cache_create; NULL keeps the cache private. */
+int cache_set_shared(const char *name);
+
+/* Returns 1 on success and -1 on failure. Sets the file used to keep the cache
+ * contents across restarts. When set, cache_create restores the entries (and
+ * their recency order) saved in it, and cache_destroy saves them back. Must be
+ * called before cache_create; NULL turns snapshots off. */
+int cache_set_snapshot_file(const char *path);
+
+/* Returns 1 on success and -1 on failure. Writes the valid entries of the cache
+ * to the snapshot file through a shared memory mapping. */
+int cache_save_snapshot(void);
+
+/* Returns the number of entries restored by cache_create that have not been
+ * checked against the device yet. */
+int cache_num_restored(void);
+
+/* Returns 1 and fills |disk_num|, |block_num| and |buf| with the |index|-th
+ * restored entry, or -1 if there is no such entry. */
+int cache_get_restored(int index, int *disk_num, int *block_num, uint8_t *buf);
+
+/* Marks the restored entries as checked. If |keep| is false they are dropped
+ * from the cache because the device no longer holds the same contents. */
+void cache_finish_restore(bool keep);
+
 #endif
@@ -0,0 +1,188 @@
+/* Stand-in JBOD server that implements JBOD_WRITE_SAME, see fill_server.h. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "util.h"
+#include "fill_server.h"
+
+#define FILL_SERVER_ARGUMENTS "hp:n"
+#define USAGE                                                            \
+  "USAGE: fill_server [-h] [-p port] [-n]\n"                             \
+  "\n"                                                                   \
+  "where:\n"                                                             \
+  "    -h - help mode (display this message)\n"                          \
+  "    -p - port to listen on (default 3333)\n"                          \
+  "    -n - reject JBOD_WRITE_SAME like the reference server does\n"     \
+  "\n"                                                                   \
+
+static uint8_t device[JBOD_NUM_DISKS][JBOD_NUM_BLOCKS_PER_DISK][JBOD_BLOCK_SIZE];
+static bool mounted = false;
+static bool write_same = true;
+static uint32_t curr_disk = 0;
+static uint32_t curr_block = 0;
+static long num_fills = 0;
+
+
+// Moves the head past the block it just read or wrote, on to the next disk after the last block
+static void advance(void)
+{
+  if (++curr_block == JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    curr_block = 0;
+    curr_disk = (curr_disk + 1) % JBOD_NUM_DISKS;
+  }
+}
+
+uint16_t fill_server_operation(uint32_t op, uint8_t *block, bool *with_block)
+{
+  uint32_t cmd = (op >> 14) & 0x3f;
+  uint32_t disk_num = op >> 28;
+  uint32_t block_num = (op >> 20) & 0xff;
+
+  *with_block = false;
+  if (cmd == JBOD_MOUNT)
+  {
+    if (mounted == true)
+    {
+      return -1;
+    }
+    memset(device, 0, sizeof(device));
+    mounted = true;
+    curr_disk = 0;
+    curr_block = 0;
+    return 0;
+  }
+  if (mounted == false)
+  {
+    return -1;
+  }
+
+  switch (cmd)
+  {
+    case JBOD_UNMOUNT:
+      mounted = false;
+      return 0;
+    case JBOD_SEEK_TO_DISK:
+      curr_disk = disk_num;
+      return 0;
+    case JBOD_SEEK_TO_BLOCK:
+      curr_block = block_num;
+      return 0;
+    case JBOD_READ_BLOCK:
+      memcpy(block, device[curr_disk][curr_block], JBOD_BLOCK_SIZE);
+      *with_block = true;
+      advance();
+      return 0;
+    case JBOD_WRITE_BLOCK:
+      memcpy(device[curr_disk][curr_block], block, JBOD_BLOCK_SIZE);
+      advance();
+      return 0;
+    case JBOD_SIGN_BLOCK:
+      format_block_sig(disk_num, block_num, device[disk_num][block_num], (char *) block, JBOD_BLOCK_SIZE);
+      *with_block = true;
+      return 0;
+    case JBOD_WRITE_SAME:
+      if (write_same == false)
+      {
+        return -1;
+      }
+      memset(device[curr_disk][curr_block], op & 0xff, JBOD_BLOCK_SIZE);
+      num_fills++;
+      advance();
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+static bool read_all(int sd, uint8_t *buf, int len)
+{
+  for (int done = 0, n; done < len; done += n)
+  {
+    if ((n = read(sd, buf + done, len - done)) <= 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Answers the requests of one client until it disconnects
+static void serve(int sd)
+{
+  uint8_t packet[HEADER_LEN + JBOD_BLOCK_SIZE];
+  uint16_t length, ret;
+  uint32_t op;
+
+  while (read_all(sd, packet, HEADER_LEN) == true)
+  {
+    memcpy(&length, packet, sizeof(length));
+    memcpy(&op, packet + 2, sizeof(op));
+    length = ntohs(length);
+    op = ntohl(op);
+    if (length == HEADER_LEN + JBOD_BLOCK_SIZE && read_all(sd, packet + HEADER_LEN, JBOD_BLOCK_SIZE) == false)
+    {
+      return;
+    }
+
+    bool with_block;
+    ret = htons(fill_server_operation(op, packet + HEADER_LEN, &with_block));
+    length = htons(with_block == true ? HEADER_LEN + JBOD_BLOCK_SIZE : HEADER_LEN);
+    memcpy(packet, &length, sizeof(length));
+    memcpy(packet + 6, &ret, sizeof(ret));
+    if (write(sd, packet, ntohs(length)) != ntohs(length))
+    {
+      return;
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int ch, port = FILL_SERVER_PORT;
+
+  while ((ch = getopt(argc, argv, FILL_SERVER_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'p':
+        port = atoi(optarg);
+        break;
+      case 'n':
+        write_same = false;
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  int listen_sd = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  setsockopt(listen_sd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (listen_sd == -1 || bind(listen_sd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(listen_sd, 1) == -1)
+    err(1, "Cannot listen on port %d", port);
+
+  for (;;) {
+    int sd = accept(listen_sd, NULL, NULL);
+    if (sd == -1)
+      continue;
+    setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    serve(sd);
+    close(sd);
+    fprintf(stderr, "Client disconnected, %ld fills so far\n", num_fills);
+  }
+}
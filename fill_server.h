@@ -0,0 +1,20 @@
+#ifndef FILL_SERVER_H_
+#define FILL_SERVER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Stand-in JBOD server for trying JBOD_WRITE_SAME (see net.h), which the
+ * prebuilt jbod_server does not implement. It keeps the device in memory and
+ * serves one client at a time like the real server: MOUNT zeroes the device,
+ * READ and WRITE advance the head, and every command it does not know or
+ * cannot run now is answered with a return value of -1. Started with -n it
+ * rejects JBOD_WRITE_SAME as well, which exercises the client's fallback. */
+
+#define FILL_SERVER_PORT 3333
+
+/* Returns the return value of |op| for the response, filling |block| for the
+ * commands that send one back. Sets |*with_block| accordingly. */
+uint16_t fill_server_operation(uint32_t op, uint8_t *block, bool *with_block);
+
+#endif
@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAX_LEN 1024  // Largest mdadm_write
+
+// What precedes the bytes of each write in the journal
+typedef struct {
+  uint32_t magic;
+  uint32_t addr;
+  uint32_t len;
+  uint32_t checksum;  // Over addr, len and the bytes
+} journal_record_t;
+
+static int fd = -1;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;  // Keeps the records of concurrent appends apart
+static long num_records = 0;
+static long num_fsyncs = 0;
+
+
+// FNV-1a, enough to tell a record that was only partly written before a crash
+static uint32_t checksum(uint32_t addr, uint32_t len, const uint8_t *buf)
+{
+  uint32_t hash = 2166136261u;
+  uint32_t fields[2] = { addr, len };
+
+  for (size_t i = 0; i < sizeof(fields); i++)
+  {
+    hash = (hash ^ ((const uint8_t *) fields)[i]) * 16777619u;
+  }
+  for (uint32_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ buf[i]) * 16777619u;
+  }
+  return hash;
+}
+
+static bool write_all(const uint8_t *buf, size_t len)
+{
+  while (len > 0)
+  {
+    ssize_t written = write(fd, buf, len);
+    if (written < 0)
+    {
+      return false;
+    }
+    buf += written;
+    len -= written;
+  }
+  return true;
+}
+
+int journal_open(const char *path)
+{
+  journal_close();
+  fd = open(path, O_RDWR | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR);
+  return fd == -1 ? -1 : 1;
+}
+
+void journal_close(void)
+{
+  if (fd != -1)
+  {
+    close(fd);
+    fd = -1;
+  }
+}
+
+bool journal_enabled(void)
+{
+  return fd != -1;
+}
+
+bool journal_empty(void)
+{
+  struct stat st;
+  return fd == -1 || (fstat(fd, &st) == 0 && st.st_size == 0);
+}
+
+int journal_append(uint32_t addr, uint32_t len, const uint8_t *buf)
+{
+  if (fd == -1 || len > JOURNAL_MAX_LEN || (len > 0 && buf == NULL))
+  {
+    return -1;
+  }
+
+  uint8_t record[sizeof(journal_record_t) + JOURNAL_MAX_LEN];
+  journal_record_t header = { JOURNAL_MAGIC, addr, len, checksum(addr, len, buf) };
+  memcpy(record, &header, sizeof(header));
+  memcpy(record + sizeof(header), buf, len);
+
+  pthread_mutex_lock(&lock);
+  bool written = write_all(record, sizeof(header) + len);
+  int rc = written == true && fdatasync(fd) == 0 ? 1 : -1;
+  num_records++;
+  num_fsyncs += written == true;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+int journal_replay(int (*apply)(uint32_t addr, uint32_t len, const uint8_t *buf))
+{
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  uint8_t buf[JOURNAL_MAX_LEN];
+  journal_record_t header;
+  off_t offset = 0;
+  int applied = 0;
+
+  while (pread(fd, &header, sizeof(header), offset) == sizeof(header))
+  {
+    if (header.magic != JOURNAL_MAGIC || header.len > JOURNAL_MAX_LEN ||
+        pread(fd, buf, header.len, offset + sizeof(header)) != header.len ||
+        checksum(header.addr, header.len, buf) != header.checksum)
+    {
+      break;  // Torn tail of a crashed run, nothing after it was acknowledged
+    }
+    if (apply(header.addr, header.len, buf) == -1)
+    {
+      return -1;
+    }
+    applied++;
+    offset += sizeof(header) + header.len;
+  }
+  return applied;
+}
+
+int journal_reset(void)
+{
+  if (fd == -1)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&lock);
+  int rc = ftruncate(fd, 0) == 0 && fdatasync(fd) == 0 ? 1 : -1;
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+void journal_print_stats(void)
+{
+  fprintf(stderr, "Journal: %ld records, %ld fsyncs\n", num_records, num_fsyncs);
+}
@@ -0,0 +1,47 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Append-only intent log of the writes that were acknowledged before reaching
+ * the JBOD. Each record holds the address, the length and the bytes of one
+ * mdadm_write, with a checksum so a record torn by a crash is recognized. */
+
+#define JOURNAL_MAGIC 0x4a424a4c  // "JBJL"
+
+/* Returns 1 on success and -1 on failure. Opens (creating it if needed) the
+ * journal at |path|. Records already in it are kept for journal_replay. */
+int journal_open(const char *path);
+
+/* Closes the journal, if one is open. */
+void journal_close(void);
+
+/* Returns true if a journal is open. */
+bool journal_enabled(void);
+
+/* Returns true if no journal is open or the open one holds no records, i.e.
+ * there is nothing for journal_replay to apply. */
+bool journal_empty(void);
+
+/* Returns 1 once the record is durable and -1 on failure. Every record costs
+ * one fdatasync of the local file, which is the whole latency of a write
+ * acknowledged through the journal. Records are not batched across calls:
+ * mdadm_write, the only caller, acknowledges one write at a time and a write
+ * may only be acknowledged once its own record is durable, so there is never
+ * a second record to share the fsync with. */
+int journal_append(uint32_t addr, uint32_t len, const uint8_t *buf);
+
+/* Returns the number of records applied, or -1 on failure. Calls |apply| on
+ * every intact record of the journal in the order they were appended, up to
+ * the first torn or corrupted one. */
+int journal_replay(int (*apply)(uint32_t addr, uint32_t len, const uint8_t *buf));
+
+/* Returns 1 on success and -1 on failure. Empties the journal once every
+ * write it holds has reached the JBOD. */
+int journal_reset(void);
+
+/* Prints how many records were appended and how many fsyncs committed them. */
+void journal_print_stats(void);
+
+#endif
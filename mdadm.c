@@ -21,31 +21,635 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "cache.h"
 #include "mdadm.h"
 #include "util.h"
 #include "jbod.h"
 #include "net.h"
+#include "sched.h"
+#include "journal.h"
+#include "sigcache.h"
+
+#define RESTORE_SAMPLES 16  // How many restored cache entries are checked against the device at mount
+
+#define WC_MAX_BLOCKS 256    // Upper bound on how many blocks the write-combining buffer may hold
+#define MAX_IO_BLOCKS (1024 / JBOD_BLOCK_SIZE + 1)  // Most blocks a single read or write of up to 1024 bytes can touch
+#define BLOCKS_PER_JBOD (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define MAX_VOLUME_BLOCKS (JBOD_MAX_BACKENDS * BLOCKS_PER_JBOD)
 
 int is_mounted = 0;  // variable in order to keep track ,throughout unitl the program terminates,if the mdam is mounted or not, in order to avoid mounting twice without having an unmount called before hand, and vice versa.
                     // Mounted = 1, Unmounted = 0           
 
+// A block with writes that were acknowledged but not sent to the JBOD yet. Only the bytes marked dirty
+// were written by the user, the rest of the block is filled from the device when the entry is flushed.
+typedef struct {
+  uint32_t disk_num;
+  uint32_t block_num;
+  uint8_t block[JBOD_BLOCK_SIZE];
+  bool dirty[JBOD_BLOCK_SIZE];
+  int dirty_bytes;
+  long first_write_ms;  // When the entry was created, used for the age threshold
+} wc_entry_t;
+
+// One block of a batch going through the scheduler
+typedef struct {
+  uint32_t disk_num;
+  uint32_t block_num;
+  uint8_t block[JBOD_BLOCK_SIZE];
+  uint32_t offset;   // Part of the block the caller's range covers
+  uint32_t length;
+  bool ready;        // The block already holds its current contents, fetch_blocks leaves it alone
+  bool overwrite;    // The caller replaces all of the block, a cache miss does not need to read it from the device
+  bool from_device;  // Set by fetch_blocks when the block was not in the cache
+} block_io_t;
+
+static wc_entry_t wc_entries[WC_MAX_BLOCKS];
+static int wc_num_entries = 0;
+static int wc_max_blocks = 0;  // 0 means write combining is off and writes go straight to the device
+static int wc_max_age_ms = 0;
+
+static mdadm_layout_t layout = MDADM_CONCAT;
+static bool replaying = false;  // The journal is being applied at mount, its records must not be journaled again
+static bool journal_held = false;  // A journaled write is being added to the buffer, a flush must not reset the journal
+
+// Copy-on-write snapshots. Snapshots are numbered in the order they were taken and write_epoch[b] is the number
+// of snapshots that existed when block b of the volume was last written. A write to a block whose write_epoch is
+// behind is the first one since the latest snapshot, so the old contents are copied to snap_blocks first and the
+// latest snapshot's remap table points at the copy. A snapshot reads a block from the first copy made for it or
+// a later snapshot, and from the live volume when there is none (the block has not changed since).
+static int write_epoch[MAX_VOLUME_BLOCKS];
+static int *snap_remap[MDADM_MAX_SNAPSHOTS];  // Per volume block, 1 + index in snap_blocks, 0 if not copied
+static int num_snapshots = 0;
+static uint8_t (*snap_blocks)[JBOD_BLOCK_SIZE] = NULL;
+static int snap_num_blocks = 0;
+static int snap_capacity = 0;
+
+
+static long now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static int num_backends(void)
+{
+  int n = jbod_num_backends();
+  return n > 0 ? n : 1;  // Not connected yet, sizes are those of a single JBOD
+}
+
+uint32_t mdadm_volume_size(void)
+{
+  int jbods = layout == MDADM_MIRRORED ? 1 : num_backends();  // Mirrors all hold the same data
+  return jbods * JBOD_NUM_DISKS * JBOD_DISK_SIZE;
+}
+
+// Finds the backend, disk and block that hold block |block_num| of disk |disk_num| of the volume. Above this
+// point (cache, write combining) blocks are known by their position in the volume, the scheduler and the wire
+// only deal with the position on a given JBOD. Mirrors hold every block at the same place, backend 0 is returned
+// for them.
+static void map_block(uint32_t disk_num, uint32_t block_num, int *backend, uint32_t *jbod_disk, uint32_t *jbod_block)
+{
+  uint32_t volume_block = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+
+  if (layout == MDADM_STRIPED)
+  {
+    *backend = volume_block % num_backends();
+    volume_block /= num_backends();
+  }
+  else if (layout == MDADM_MIRRORED)
+  {
+    *backend = 0;
+  }
+  else
+  {
+    *backend = volume_block / BLOCKS_PER_JBOD;
+    volume_block %= BLOCKS_PER_JBOD;
+  }
+  *jbod_disk = volume_block / JBOD_NUM_BLOCKS_PER_DISK;
+  *jbod_block = volume_block % JBOD_NUM_BLOCKS_PER_DISK;
+}
+
+int mdadm_volume_position(int backend, uint32_t disk_num, uint32_t block_num, uint32_t *volume_disk, uint32_t *volume_block)
+{
+  if (backend < 0 || backend >= num_backends() || disk_num >= JBOD_NUM_DISKS || block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    return -1;
+  }
+
+  uint32_t jbod_block = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
+  uint32_t position = jbod_block;  // Every mirror holds the whole volume
+  if (layout == MDADM_STRIPED)
+  {
+    position = jbod_block * num_backends() + backend;
+  }
+  else if (layout == MDADM_CONCAT)
+  {
+    position = backend * BLOCKS_PER_JBOD + jbod_block;
+  }
+  *volume_disk = position / JBOD_NUM_BLOCKS_PER_DISK;
+  *volume_block = position % JBOD_NUM_BLOCKS_PER_DISK;
+  return 1;
+}
+
+int mdadm_set_layout(mdadm_layout_t new_layout)
+{
+  if (is_mounted == 1 || new_layout < MDADM_CONCAT || new_layout > MDADM_MIRRORED)
+  {
+    return -1;
+  }
+  layout = new_layout;
+  return 1;
+}
+
+// Queues a read or write of one block of the volume on the backend that holds it. With mirrors a write goes to
+// every one of them and a read to |mirror|.
+static int submit_block(jbod_cmd_t cmd, block_io_t *io, int mirror)
+{
+  int backend;
+  uint32_t jbod_disk, jbod_block;
+
+  map_block(io->disk_num, io->block_num, &backend, &jbod_disk, &jbod_block);
+  if (layout != MDADM_MIRRORED)
+  {
+    return sched_submit(backend, cmd, jbod_disk, jbod_block, io->block);
+  }
+  if (cmd == JBOD_READ_BLOCK)
+  {
+    return sched_submit(mirror, cmd, jbod_disk, jbod_block, io->block);
+  }
+
+  for (int b = 0; b < num_backends(); b++)
+  {
+    if (sched_submit(b, cmd, jbod_disk, jbod_block, io->block) == -1)
+    {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+// The mirror a read should go to: the one that would serve it the soonest, given what is already queued on each
+// one and how fast each has been so far
+static int pick_mirror(void)
+{
+  int best = 0;
+
+  for (int b = 1; b < num_backends(); b++)
+  {
+    if (sched_backend_load(b) < sched_backend_load(best))
+    {
+      best = b;
+    }
+  }
+  return best;
+}
+
+// Sends an operation that is not about a block (mount, unmount) to every backend. Returns how many of them
+// succeeded before the first failure.
+static int broadcast_operation(uint32_t op)
+{
+  for (int b = 0; b < num_backends(); b++)
+  {
+    if (jbod_backend_operation(b, op, NULL) == -1)
+    {
+      return b;
+    }
+  }
+  return num_backends();
+}
+
+// Splits the range [addr, addr + len) into the blocks it covers, noting for each one the part of it the range
+// covers. Returns how many blocks were filled in.
+static int split_into_blocks(uint32_t addr, uint32_t len, block_io_t *io)
+{
+  uint32_t curr_address = addr;
+  uint32_t done_so_far = 0;
+  uint32_t remaining_length;  // Keeping track of how much is left of the range
+  uint32_t remainingSpace_currBlock;  // Keeping track of how much space can the current block hold
+  int num_blocks = 0;
+
+  while(done_so_far < len)
+  {
+    block_io_t *curr = &io[num_blocks++];
+    curr->disk_num = curr_address / JBOD_DISK_SIZE;       // As we are iterating through while loop we need to find the current disk ID and current block ID with the current address
+    curr->block_num = (curr_address % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
+    curr->offset = curr_address % JBOD_BLOCK_SIZE;       // Indicating the position we are within the block.
+    curr->ready = false;
+    curr->overwrite = false;
+    remaining_length = len - done_so_far;
+    remainingSpace_currBlock = JBOD_BLOCK_SIZE - curr->offset;
+
+    if(remaining_length <= remainingSpace_currBlock) // checking if the remaining length fits within the current block
+      {
+        curr->length = remaining_length;
+      }
+    else
+      {
+        curr->length = remainingSpace_currBlock;
+      }
+
+    done_so_far += curr->length;
+    curr_address += curr->length;
+  }
+
+  return num_blocks;
+}
+
+static uint32_t volume_block_of(const block_io_t *io)
+{
+  return io->disk_num * JBOD_NUM_BLOCKS_PER_DISK + io->block_num;
+}
+
+// The one table lookup writes pay for snapshots
+static bool snap_needs_copy(const block_io_t *io)
+{
+  return write_epoch[volume_block_of(io)] < num_snapshots;
+}
+
+// Keeps |old| as the contents of the block in the latest snapshot
+static int snap_preserve(const block_io_t *io, const uint8_t *old)
+{
+  if (snap_num_blocks == snap_capacity)
+  {
+    int capacity = snap_capacity > 0 ? 2 * snap_capacity : 64;
+    uint8_t (*bigger)[JBOD_BLOCK_SIZE] = realloc(snap_blocks, capacity * sizeof(*snap_blocks));
+    if (bigger == NULL)
+    {
+      return -1;
+    }
+    snap_blocks = bigger;
+    snap_capacity = capacity;
+  }
+
+  memcpy(snap_blocks[snap_num_blocks], old, JBOD_BLOCK_SIZE);
+  snap_remap[num_snapshots - 1][volume_block_of(io)] = ++snap_num_blocks;
+  write_epoch[volume_block_of(io)] = num_snapshots;
+  return 1;
+}
+
+static void snap_drop_all(void)
+{
+  for (int s = 0; s < num_snapshots; s++)
+  {
+    free(snap_remap[s]);
+    snap_remap[s] = NULL;
+  }
+  free(snap_blocks);
+  snap_blocks = NULL;
+  snap_num_blocks = 0;
+  snap_capacity = 0;
+  num_snapshots = 0;
+  memset(write_epoch, 0, sizeof(write_epoch));
+}
+
+// Fills in the current contents of a batch of blocks (skipping the ones already marked ready). Cache hits are
+// served right away, the misses are queued in the scheduler so they reach the JBOD in the order that needs the
+// fewest seeks, and are then inserted in the cache.
+static int fetch_blocks(block_io_t *io, int count)
+{
+  int misses = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    io[i].from_device = io[i].ready == false &&
+                        !(cache_enabled() == true && cache_lookup(io[i].disk_num, io[i].block_num, io[i].block) == 1) &&
+                        io[i].overwrite == false;  // Still looked up, so the hit rate counts every block a write covers
+    misses += io[i].from_device == true;
+  }
+
+  // With mirrors the misses are split in one run of consecutive blocks per mirror, each run going to the mirror
+  // that is the least loaded at that point. Runs keep the JBOD head moving forward instead of seeking on every block.
+  int run_length = layout == MDADM_MIRRORED ? (misses + num_backends() - 1) / num_backends() : misses;
+  int submitted = 0;
+  int mirror = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (io[i].from_device == false)
+    {
+      continue;
+    }
+    if (submitted++ % run_length == 0 && layout == MDADM_MIRRORED)
+    {
+      mirror = pick_mirror();
+    }
+    if (submit_block(JBOD_READ_BLOCK, &io[i], mirror) == -1)
+    {
+      return -1;
+    }
+  }
+
+  if (sched_run() == -1)
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if (io[i].from_device == true && cache_enabled() == true)  // Cache miss, we keep the block around for the next time
+    {
+      cache_insert(io[i].disk_num, io[i].block_num, io[i].block);
+    }
+  }
+
+  // Hits were refreshed when they were looked up and misses only now, so we touch the blocks once more in the
+  // caller's order. That way the LRU order is the same as if the blocks had been read one after the other.
+  for (int i = 0; i < count && cache_enabled() == true; i++)
+  {
+    if (io[i].ready == false)
+    {
+      cache_touch(io[i].disk_num, io[i].block_num);
+    }
+  }
+  return 1;
+}
+
+// Writes a batch of whole blocks to the JBOD through the scheduler and keeps the cache in sync with them
+static int store_blocks(block_io_t *io, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    if (submit_block(JBOD_WRITE_BLOCK, &io[i], 0) == -1)
+    {
+      return -1;
+    }
+  }
+
+  if (sched_run() == -1)
+  {
+    return -1;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    if(cache_enabled() == true)
+    {
+      cache_insert(io[i].disk_num, io[i].block_num, (const uint8_t *) io[i].block);  // Updates the entry if it is cached already
+    }
+  }
+  return 1;
+}
+
+static wc_entry_t *wc_find(uint32_t disk_num, uint32_t block_num)
+{
+  for (int i = 0; i < wc_num_entries; i++)
+  {
+    if (wc_entries[i].disk_num == disk_num && wc_entries[i].block_num == block_num)
+    {
+      return &wc_entries[i];
+    }
+  }
+  return NULL;
+}
+
+// Sends the combined blocks from |first| to the end of the buffer to the device and drops them from it. Blocks
+// that were completely overwritten are written as they are, the others need the current contents of the block
+// under the bytes that were not written, which are all read in one batch before all the writes go out.
+static int wc_flush_tail(int first)
+{
+  static block_io_t io[WC_MAX_BLOCKS];
+  int count = wc_num_entries - first;
+  int partial = 0;
+
+  for (int i = 0; i < count; i++)
+  {
+    wc_entry_t *entry = &wc_entries[first + i];
+    if (entry->dirty_bytes < JBOD_BLOCK_SIZE)
+    {
+      io[partial].disk_num = entry->disk_num;
+      io[partial].block_num = entry->block_num;
+      io[partial].ready = false;
+      io[partial].overwrite = false;
+      partial++;
+    }
+  }
+  if (partial > 0 && fetch_blocks(io, partial) == -1)
+  {
+    return -1;
+  }
+
+  // Partial blocks are at the front of io in the same order as in the buffer, so we walk both together
+  for (int i = count - 1, p = partial - 1; i >= 0; i--)
+  {
+    wc_entry_t *entry = &wc_entries[first + i];
+    if (entry->dirty_bytes < JBOD_BLOCK_SIZE)
+    {
+      for (int j = 0; j < JBOD_BLOCK_SIZE; j++)
+      {
+        if (entry->dirty[j] == true)
+        {
+          io[p].block[j] = entry->block[j];
+        }
+      }
+      io[i] = io[p--];  // i >= p, so this never overwrites a partial block we still need
+    }
+    else
+    {
+      io[i].disk_num = entry->disk_num;
+      io[i].block_num = entry->block_num;
+      memcpy(io[i].block, entry->block, JBOD_BLOCK_SIZE);
+    }
+  }
+
+  if (store_blocks(io, count) == -1)
+  {
+    return -1;
+  }
+
+  wc_num_entries = first;
+  if (wc_num_entries == 0 && journal_enabled() == true && replaying == false && journal_held == false)
+  {
+    return journal_reset();  // Every acknowledged write is on the JBOD now, the journal has nothing left to protect
+  }
+  return 1;
+}
+
+// Sends one combined block to the device
+static int wc_flush_entry(wc_entry_t *entry)
+{
+  // The buffer is unordered, so we move the entry to the end and flush just that
+  wc_entry_t last = wc_entries[wc_num_entries - 1];
+  wc_entries[wc_num_entries - 1] = *entry;
+  *entry = last;
+  return wc_flush_tail(wc_num_entries - 1);
+}
+
+static int wc_flush_all(void)
+{
+  return wc_num_entries == 0 ? 1 : wc_flush_tail(0);
+}
+
+// Flushes the buffer if the blocks of a write would not all fit in it, so that adding them does not flush it halfway
+static int wc_make_room(const block_io_t *io, int num_blocks)
+{
+  int missing = 0;
+  for (int i = 0; i < num_blocks; i++)
+  {
+    missing += wc_find(io[i].disk_num, io[i].block_num) == NULL;
+  }
+  return wc_num_entries + missing > wc_max_blocks ? wc_flush_all() : 1;
+}
+
+// Flushes everything once the oldest pending write is older than the age threshold
+static int wc_flush_expired(void)
+{
+  if (wc_num_entries == 0 || wc_max_age_ms <= 0)
+  {
+    return 1;
+  }
+
+  long now = now_ms();
+  for (int i = 0; i < wc_num_entries; i++)
+  {
+    if (now - wc_entries[i].first_write_ms >= wc_max_age_ms)
+    {
+      return wc_flush_all();
+    }
+  }
+  return 1;
+}
+
+// Merges |len| bytes at |offset| of a block into the buffer, making room first if it is full
+static int wc_add(uint32_t disk_num, uint32_t block_num, uint32_t offset, uint32_t len, const uint8_t *buf)
+{
+  wc_entry_t *entry = wc_find(disk_num, block_num);
+
+  if (entry == NULL)
+  {
+    if (wc_num_entries == wc_max_blocks && wc_flush_all() == -1)
+    {
+      return -1;
+    }
+    entry = &wc_entries[wc_num_entries++];
+    entry->disk_num = disk_num;
+    entry->block_num = block_num;
+    entry->dirty_bytes = 0;
+    entry->first_write_ms = now_ms();
+    memset(entry->dirty, 0, sizeof(entry->dirty));
+  }
+
+  memcpy(entry->block + offset, buf, len);
+  for (uint32_t i = offset; i < offset + len; i++)
+  {
+    if (entry->dirty[i] == false)
+    {
+      entry->dirty[i] = true;
+      entry->dirty_bytes++;
+    }
+  }
+  return 1;
+}
+
+// The cache may have been warmed from a snapshot of an earlier run. Before trusting it we ask the server to sign
+// a sample of the restored blocks and compare that with the signature of what we have cached. A single mismatch
+// means the device changed underneath us (e.g. it was reformatted), so the whole snapshot is thrown away.
+static void validate_restored_cache(void)
+{
+  int restored = cache_num_restored();
+  int samples = restored < RESTORE_SAMPLES ? restored : RESTORE_SAMPLES;
+  uint8_t cached[JBOD_BLOCK_SIZE];
+  uint8_t sig[JBOD_BLOCK_SIZE];
+  char expected[JBOD_BLOCK_SIZE];
+  int disk_num, block_num;
+  bool keep = true;
+
+  for (int i = 0; i < samples && keep == true; i++)
+  {
+    int index = (int) ((long) i * restored / samples);  // Spread the samples over the whole recency order
+    if (cache_get_restored(index, &disk_num, &block_num, cached) == -1)
+    {
+      continue;
+    }
+    int backend;
+    uint32_t jbod_disk, jbod_block;
+    map_block(disk_num, block_num, &backend, &jbod_disk, &jbod_block);
+    format_block_sig(jbod_disk, jbod_block, cached, expected, sizeof(expected));
+    if (jbod_backend_operation(backend, jbod_disk << 28 | jbod_block << 20 | JBOD_SIGN_BLOCK << 14, sig) == -1 ||
+        strncmp((char *) sig, expected, sizeof(expected)) != 0)
+    {
+      keep = false;
+    }
+  }
+
+  cache_finish_restore(keep);
+}
+
+static int replay_write(uint32_t addr, uint32_t len, const uint8_t *buf)
+{
+  return mdadm_write(addr, len, buf) == -1 ? -1 : 1;
+}
+
+// Writes that were acknowledged by an earlier run but never reached the JBOD are applied again, in order. Writes
+// that did reach it are rewritten with the same bytes, which is harmless. The journal is only emptied once all of
+// them are on the JBOD, so a crash in the middle of this just replays again on the next mount.
+static int replay_journal(void)
+{
+  replaying = true;
+  int rc = journal_replay(replay_write) == -1 || wc_flush_all() == -1 ? -1 : 1;
+  replaying = false;
+  return rc == 1 ? journal_reset() : -1;
+}
+
+// Mounts every backend, returning how many were mounted before one failed. A client that crashed with writes in
+// the journal never unmounted, so its backends are still mounted and refuse the mount. That is the very case the
+// journal is for. The protocol only reports that the mount failed, not why, so such a backend is asked to seek to
+// its first block, which only a mounted JBOD does: then it is taken over as it is. Unmounting and mounting it again
+// would zero it, and with it every write that reached it before the crash.
+static int mount_backends(void)
+{
+  bool recover = journal_empty() == false;
+
+  for (int b = 0; b < num_backends(); b++)
+  {
+    if (jbod_backend_operation(b, JBOD_MOUNT << 14, NULL) == -1 &&
+        (recover == false || jbod_backend_operation(b, JBOD_SEEK_TO_DISK << 14, NULL) == -1 ||
+         jbod_backend_operation(b, JBOD_SEEK_TO_BLOCK << 14, NULL) == -1))
+    {
+      return b;
+    }
+  }
+  return num_backends();
+}
+
 int mdadm_mount(void) 
 {
   
    // Checking if JBOD is mounted or not and that the operation is successfull
                                         
-  if( (is_mounted == 0) && (jbod_client_operation( JBOD_MOUNT << 14, NULL) == 0))  // As per instructions were allowed to pass NULL for the parameter block 
+  if (is_mounted == 1)
+  {
+    return -1;
+  }
+
+  int mounted = mount_backends();
+  if( mounted == num_backends() )  // Every backend of the volume has to be mounted
   {                                  
       is_mounted = 1;
+      sched_reset_position();  // Mounting puts the JBOD back on its first disk and block
+      sigcache_reset();  // Nothing says the JBOD holds what the kept signatures were computed from
+      if (cache_enabled() == true && cache_num_restored() > 0)
+      {
+        validate_restored_cache();
+      }
+      if (journal_enabled() == true && replay_journal() == -1)
+      {
+        wc_num_entries = 0;  // The journal still has them, the next mount tries again
+        is_mounted = 0;
+        broadcast_operation(JBOD_UNMOUNT << 14);
+        return -1;
+      }
       return 1;
   }
 
   else
    {
-    
-      return -1; // if the operation fails or that the mdam is mounted, we return -1;
+      for (int b = 0; b < mounted; b++)
+      {
+        jbod_backend_operation(b, JBOD_UNMOUNT << 14, NULL);  // Don't leave the volume half mounted
+      }
+      return -1; // if the operation fails we return -1;
    }
 
 
@@ -53,10 +657,22 @@ int mdadm_mount(void)
 
 int mdadm_unmount(void) 
 {                                                   
-  if( (is_mounted == 1) && (jbod_client_operation( JBOD_UNMOUNT << 14, NULL) == 0))   // Similar functionality as in the mount() and can have NULL for the block parameter
+  if (is_mounted == 1 && wc_flush_all() == -1)
+  {
+    return -1;  // Pending writes have to reach the JBOD before it goes away
+  }
+
+  if( (is_mounted == 1) && (broadcast_operation( JBOD_UNMOUNT << 14) == num_backends()))   // Similar functionality as in the mount() and can have NULL for the block parameter
   {                                 
+    if (cache_enabled() == true)
+    {
+      cache_save_snapshot(); // Keep the warm cache for the next mount, this is a no-op if snapshots are off
+    }
+
      // To inform that now the JDOB is unmounted and ready to be mounted again before any other operation.
     is_mounted = 0;
+    snap_drop_all();  // Nothing says the JBOD will hold the same data when it is mounted again
+    sched_reset_position();
     return 1;
   }
 
@@ -67,83 +683,85 @@ int mdadm_unmount(void)
   }
 }
 
-
-int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) 
+int mdadm_set_journal(const char *path)
 {
+  if (is_mounted == 1)
+  {
+    return -1;
+  }
+  if (path == NULL)
+  {
+    journal_close();
+    return 1;
+  }
+  return journal_open(path);
+}
 
-  if( (is_mounted == 0) || (len > 1024) || (addr > ( JBOD_DISK_SIZE * JBOD_NUM_DISKS ) ) || ( len != 0 && buf == NULL) || (len + addr) > ( JBOD_DISK_SIZE * JBOD_NUM_DISKS) )
+int mdadm_write_combine(int max_blocks, int max_age_ms)
+{
+  if (max_blocks < 0 || max_blocks > WC_MAX_BLOCKS || wc_flush_all() == -1)
   {
-    return -1;  // testing the invalid parameters, simiilar to the mdadm_read() 
+    return -1;
   }
+  wc_max_blocks = max_blocks;
+  wc_max_age_ms = max_age_ms;
+  return 1;
+}
 
-// obtain the respective addresses
-  uint32_t curr_address = addr;
-  
-  uint32_t disk_address =  addr / JBOD_DISK_SIZE;   // Locate which disk are we starting on.
-  uint32_t block_address = (addr % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;    // Locate which block we are on. 
+int mdadm_flush(void)
+{
+  if (is_mounted == 0)
+  {
+    return -1;
+  }
+  return wc_flush_all();
+}
 
 
-  uint8_t *temp_buff = malloc(JBOD_BLOCK_SIZE * sizeof(uint8_t));   // creating the temporary buffer to hold a block size worth of memory
-  uint32_t read_so_far = 0; 
-  uint32_t info_to_read;
-  uint32_t offset;        // Indicating the position we are within the block.
-  uint32_t remaining_length;  // Keeping track of how much reading we need to do
-  uint32_t remainingSpace_currBlock;  // Keeping track of how much space can the current block hold
+int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf) 
+{
 
-  
+  if( (is_mounted == 0) || (len > 1024) || (addr > mdadm_volume_size()) || ( len != 0 && buf == NULL) || (len + addr) > mdadm_volume_size())
+  {
+    return -1;  // testing the invalid parameters, simiilar to the mdadm_read() 
+  }
 
-  while(read_so_far < len)  
-  { 
-    disk_address =  curr_address / JBOD_DISK_SIZE;       // As we are iterating through while loop we need to find the current disk ID and current block ID with the current address
-    block_address = (curr_address % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-    offset = curr_address % JBOD_BLOCK_SIZE; 
-    remaining_length  = len - read_so_far;  
-    remainingSpace_currBlock = JBOD_BLOCK_SIZE - offset;
+  if (wc_flush_expired() == -1)
+  {
+    return -1;
+  }
 
-    if(remaining_length <= remainingSpace_currBlock) // checking if the remaining length can be able to read within the current block 
-      {
-        info_to_read = remaining_length;
-      } 
-    else
-      {
-        info_to_read = remainingSpace_currBlock;  
-      }
+  block_io_t io[MAX_IO_BLOCKS];
+  int num_blocks = split_into_blocks(addr, len, io);
 
-    // Checking if it is a cache hit when cache is enabled
-    if(cache_enabled() == true && cache_lookup(disk_address,block_address,buf) == 1)
+  for (int i = 0; i < num_blocks; i++)
+  {
+    // Writes still sitting in the write-combining buffer have to be visible to the read. A fully written block
+    // is served straight from the buffer, a partially written one is flushed first so the device has it all.
+    wc_entry_t *pending = wc_find(io[i].disk_num, io[i].block_num);
+    if (pending != NULL && pending->dirty_bytes == JBOD_BLOCK_SIZE)
     {
-      read_so_far += info_to_read; // we do the next loop 
-      curr_address += info_to_read;
+      memcpy(io[i].block, pending->block, JBOD_BLOCK_SIZE);
+      io[i].ready = true;
     }
-
-    else 
+    else if (pending != NULL && wc_flush_entry(pending) == -1)
     {
-      jbod_client_operation( disk_address << 28 | JBOD_SEEK_TO_DISK << 14, NULL);  
-      jbod_client_operation( block_address << 20 | JBOD_SEEK_TO_BLOCK << 14, NULL);  // We need to make sure where we are before read 
-
-      if( jbod_client_operation(JBOD_READ_BLOCK << 14, temp_buff) == -1 )  // Reading the block with the temp buffer.
-      {
-        free(temp_buff);  // Make sure of no memory leaks
-        return -1; // Read Failed
-      }
-    
-      memcpy( buf + read_so_far, temp_buff + offset, info_to_read); // Making sure what we read is stored into our main buffer 
-       
-      if(cache_enabled() == true)  // this is if we are using the cache and it was cache miss we insert into the cache.
-      {
-        cache_insert(disk_address,block_address,temp_buff);
-      }
-      
-      read_so_far += info_to_read;
-      curr_address += info_to_read;
+      return -1;
     }
+  }
 
+  if (fetch_blocks(io, num_blocks) == -1)  // All the blocks we miss go to the JBOD in one batch
+  {
+    return -1; // Read Failed
+  }
 
+  uint32_t read_so_far = 0;
+  for (int i = 0; i < num_blocks; i++)
+  {
+    memcpy( buf + read_so_far, io[i].block + io[i].offset, io[i].length); // Making sure what we read is stored into our main buffer 
+    read_so_far += io[i].length;
   }
-  
-  free(temp_buff);  // Prevent memory leaks
 
- 
   return len;
 
 }
@@ -152,107 +770,202 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf)
 
 
 
+// Retires the signatures kept for the blocks of a write. mdadm_write calls it before the write, so no lookup
+// returns the old line meanwhile, and again once the bytes are on the JBOD or in the write-combining buffer: a
+// signature computed while the write was in flight may have read the generation after the first bump and still
+// signed the old contents.
+static void invalidate_signatures(const block_io_t *io, int num_blocks)
+{
+  for (int i = 0; i < num_blocks; i++)
+  {
+    sigcache_invalidate(volume_block_of(&io[i]));
+  }
+}
+
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf)   
 {
 
-  if( (is_mounted == 0) || (len > 1024) || (addr > ( JBOD_DISK_SIZE * JBOD_NUM_DISKS ) ) || ( len != 0 && buf == NULL) || (len + addr) > ( JBOD_DISK_SIZE * JBOD_NUM_DISKS) )
+  if( (is_mounted == 0) || (len > 1024) || (addr > mdadm_volume_size()) || ( len != 0 && buf == NULL) || (len + addr) > mdadm_volume_size())
   {
     return -1;  // testing the invalid parameters, simiilar to the mdadm_read() 
   }
 
-  uint32_t curr_addr = addr;
-  uint32_t curr_diskID = addr / JBOD_DISK_SIZE;
-  uint32_t curr_blockID = (addr % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-  uint8_t *temp_buf = malloc(JBOD_BLOCK_SIZE * sizeof(uint8_t));
+  if (wc_flush_expired() == -1)
+  {
+    return -1;
+  }
+
+  block_io_t io[MAX_IO_BLOCKS];
+  int num_blocks = split_into_blocks(addr, len, io);
   uint32_t written_so_far = 0;
-  uint32_t info_to_write; 
-  uint32_t offset;
-  uint32_t remaining_length_to_write;
-  uint32_t remainingSpace_of_currBlock;
 
+  invalidate_signatures(io, num_blocks);
 
-  while(written_so_far < len)
+  if (wc_max_blocks > 0)
   {
-    
-    curr_diskID = curr_addr / JBOD_DISK_SIZE;   //  Updating the current blockid and current diskid
-    curr_blockID = (curr_addr % JBOD_DISK_SIZE) / JBOD_BLOCK_SIZE;
-    offset = curr_addr % JBOD_BLOCK_SIZE;   // This is to ensure with current address we are on and how far we are in the current block we want to make sure we are not ignoring that content.
-    remaining_length_to_write = len - written_so_far;
-    remainingSpace_of_currBlock = JBOD_BLOCK_SIZE - offset;
-
-    if(remaining_length_to_write <= remainingSpace_of_currBlock)  
-      {
-        info_to_write = remaining_length_to_write;
-      }                                                            // This dicate how much can we write within the current block space we are in.
-    else
-      {
-        info_to_write = remainingSpace_of_currBlock;
-      }
-
-   
-    // Dealing with a cache hit  , if it does we need to seek to ensure we are going to write the new content, buf, and then update that in the cache
-    if(cache_enabled() == true && cache_lookup(curr_diskID,curr_blockID,temp_buf) == 1)
+    // Write combining is on, the bytes are merged into the buffer and reach the device when it is flushed. The
+    // write is acknowledged without waiting for the JBOD, so it has to be in the journal before it is in the
+    // buffer: a write that could not be journaled must never reach the device. A flush that empties the buffer
+    // resets the journal, so everything that can flush (the reads for the snapshot, making room) runs before the
+    // record is appended, and no flush resets the journal until the blocks are in the buffer.
+    for (int i = 0; i < num_blocks; i++)
     {
-      jbod_client_operation( curr_diskID << 28 | JBOD_SEEK_TO_DISK << 14, NULL);
-      jbod_client_operation( curr_blockID << 20 | JBOD_SEEK_TO_BLOCK << 14,   NULL);
-      
-      memcpy(temp_buf + offset, buf + written_so_far, info_to_write);  // Since buf is constant we need to copy the whole buf and what is already written into the temp buf therefore now we can write the correct content
-
-      if(jbod_client_operation(JBOD_WRITE_BLOCK << 14, temp_buf) == -1)  // Doing the writing operation and making sure its successful
+      uint8_t old[JBOD_BLOCK_SIZE];
+      if (snap_needs_copy(&io[i]) == true &&
+          (mdadm_read(volume_block_of(&io[i]) * JBOD_BLOCK_SIZE, JBOD_BLOCK_SIZE, old) == -1 ||
+           snap_preserve(&io[i], old) == -1))
       {
-        free(temp_buf);
         return -1;
       }
-
-      cache_update(curr_diskID,curr_blockID, (const uint8_t*) temp_buf); // Update the cache with the new content of the specific disk and block 
-      
     }
-
-    else // Dealing with a cache miss if cache is being enabled
+    if (wc_make_room(io, num_blocks) == -1)
     {
-      // We do the regular Mdadm Write Implementation as in Lab3 but now with the extra content of cache 
-      jbod_client_operation( curr_diskID << 28 | JBOD_SEEK_TO_DISK << 14, NULL);
-      jbod_client_operation( curr_blockID << 20 | JBOD_SEEK_TO_BLOCK << 14, NULL);
+      return -1;
+    }
+    if (journal_enabled() == true && replaying == false && journal_append(addr, len, buf) == -1)
+    {
+      return -1;
+    }
+    journal_held = true;  // Only a buffer smaller than one write still flushes in wc_add
+    int rc = len;
+    for (int i = 0; i < num_blocks && rc != -1; i++)
+    {
+      rc = wc_add(io[i].disk_num, io[i].block_num, io[i].offset, io[i].length, buf + written_so_far) == -1 ? -1 : rc;
+      written_so_far += io[i].length;
+    }
+    journal_held = false;
+    invalidate_signatures(io, num_blocks);
+    return rc;
+  }
 
-      if(jbod_client_operation(JBOD_READ_BLOCK << 14, temp_buf) == -1)  // This is reassure that we are not over writing content that we are not trying to write on
-      {
-        free(temp_buf);  // If reading fails we need to return -1 and make sure we don't have memory leaks
-        return -1;   
-      }
+  // Read-modify-write of the blocks: we need their current contents (from the cache or the JBOD) so we are not
+  // over writing content that we are not trying to write on, then we write the whole blocks back. Blocks the write
+  // covers entirely are not read from the device when they miss, unless a snapshot needs their old contents.
+  for (int i = 0; i < num_blocks; i++)
+  {
+    io[i].overwrite = io[i].length == JBOD_BLOCK_SIZE && snap_needs_copy(&io[i]) == false;
+  }
+  if (fetch_blocks(io, num_blocks) == -1)
+  {
+    return -1;
+  }
 
-      if(cache_enabled() == true)  // We need to insert the content we read to the cache before we can do any write operation
-      {
-       cache_insert(curr_diskID,curr_blockID,temp_buf);  // Insert into the cache
-      }
+  for (int i = 0; i < num_blocks; i++)
+  {
+    if (snap_needs_copy(&io[i]) == true && snap_preserve(&io[i], io[i].block) == -1)
+    {
+      return -1;  // The old contents were just fetched anyway, so the copy costs no I/O
+    }
+    memcpy(io[i].block + io[i].offset, buf + written_so_far, io[i].length);  // Since buf is constant we need to copy the whole buf and what is already written into the temp buf therefore now we can write the correct content
+    written_so_far += io[i].length;
+  }
 
-      // We need to seek before we write 
-      jbod_client_operation( curr_diskID << 28 | JBOD_SEEK_TO_DISK << 14, NULL);
-      jbod_client_operation( curr_blockID << 20 | JBOD_SEEK_TO_BLOCK << 14,   NULL);
+  int rc = store_blocks(io, num_blocks) == -1 ? -1 : (int) len;  // Doing the writing operation and making sure its successful
+  invalidate_signatures(io, num_blocks);  // Even a failed write may have changed some of the blocks
+  return rc;
 
-      memcpy(temp_buf + offset, buf + written_so_far, info_to_write);  // Since buf is constant we need to copy the whole buf and what is already written into the temp buf therefore now we can write the correct content
+}
 
-      if(jbod_client_operation(JBOD_WRITE_BLOCK << 14, temp_buf) == -1)  // Doing the writing operation and making sure its successful
-      {
-        free(temp_buf);
-        return -1;
-      }
+int mdadm_snapshot_create(void)
+{
+  if (is_mounted == 0 || num_snapshots == MDADM_MAX_SNAPSHOTS)
+  {
+    return -1;
+  }
+  snap_remap[num_snapshots] = calloc(MAX_VOLUME_BLOCKS, sizeof(int));  // Zeroed lazily by the OS
+  if (snap_remap[num_snapshots] == NULL)
+  {
+    return -1;
+  }
+  return num_snapshots++;
+}
 
-      if(cache_enabled() == true)
-      {
-        cache_update(curr_diskID,curr_blockID, (const uint8_t*)temp_buf); // Update the cache with the new content of the specific disk and block 
-      }
+int mdadm_snapshot_read(int snapshot, uint32_t addr, uint32_t len, uint8_t *buf)
+{
+  if (is_mounted == 0 || snapshot < 0 || snapshot >= num_snapshots || len > 1024 ||
+      (len != 0 && buf == NULL) || addr > mdadm_volume_size() || addr + len > mdadm_volume_size())
+  {
+    return -1;
+  }
 
-  
-    }
+  block_io_t io[MAX_IO_BLOCKS];
+  int num_blocks = split_into_blocks(addr, len, io);
+  uint32_t read_so_far = 0;
 
-    written_so_far += info_to_write;
-    curr_addr += info_to_write;
+  for (int i = 0; i < num_blocks; i++)
+  {
+    int copy = 0;
+    for (int s = snapshot; s < num_snapshots && copy == 0; s++)
+    {
+      copy = snap_remap[s][volume_block_of(&io[i])];
+    }
 
+    if (copy != 0)
+    {
+      memcpy(buf + read_so_far, snap_blocks[copy - 1] + io[i].offset, io[i].length);
+    }
+    else if (mdadm_read(addr + read_so_far, io[i].length, buf + read_so_far) == -1)
+    {
+      return -1;  // Unchanged since the snapshot, the live volume has it
+    }
+    read_so_far += io[i].length;
+  }
+  return len;
+}
 
+int mdadm_sign_block(uint32_t disk_num, uint32_t block_num, char *line)
+{
+  // Checked before any arithmetic, a large |disk_num| would wrap the block number around into the volume
+  if (is_mounted == 0 || line == NULL || disk_num >= mdadm_volume_size() / JBOD_DISK_SIZE ||
+      block_num >= JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    return -1;
+  }
+  uint32_t block = disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num;
 
+  int backend;
+  uint32_t jbod_disk, jbod_block;
+  map_block(disk_num, block_num, &backend, &jbod_disk, &jbod_block);
+  if (sigcache_lookup(block, line) == 1)
+  {
+    return 1;
   }
 
-free(temp_buf);
-return len; 
+  // The line is for the block with the writes acknowledged so far. A fully written block in the write-combining
+  // buffer is signed from there, a partially written one is flushed first so the cache or the JBOD has all of it.
+  uint32_t generation = sigcache_generation(block);
+  uint8_t contents[JBOD_BLOCK_SIZE];
+  bool local = false;
+  wc_entry_t *pending = wc_find(disk_num, block_num);
+  if (pending != NULL && pending->dirty_bytes == JBOD_BLOCK_SIZE)
+  {
+    memcpy(contents, pending->block, JBOD_BLOCK_SIZE);
+    local = true;
+  }
+  else if (pending != NULL && wc_flush_entry(pending) == -1)
+  {
+    return -1;
+  }
+  if (local == false)
+  {
+    local = cache_enabled() == true && cache_peek(disk_num, block_num, contents) == 1;
+  }
 
-}
\ No newline at end of file
+  if (local == true)
+  {
+    format_block_sig(jbod_disk, jbod_block, contents, line, SIGCACHE_LINE_LEN);
+  }
+  else
+  {
+    // Neither the buffer nor the cache has the block, one round trip to the JBOD signs it without moving the data
+    uint8_t sig[JBOD_BLOCK_SIZE];
+    if (jbod_backend_operation(backend, jbod_disk << 28 | jbod_block << 20 | JBOD_SIGN_BLOCK << 14, sig) == -1)
+    {
+      return -1;
+    }
+    sig[SIGCACHE_LINE_LEN - 1] = '\0';  // The line is much shorter than the block it comes back in
+    strcpy(line, (char *) sig);
+  }
+  sigcache_store(block, generation, line, local == false);
+  return 1;
+}
@@ -4,6 +4,31 @@
 #include <stdint.h>
 #include "jbod.h"
 
+#define MDADM_MAX_SNAPSHOTS 64
+
+/* How the volume is laid out over the JBOD backends (see jbod_connect_backend).
+ * CONCAT puts the backends one after the other, STRIPED spreads consecutive
+ * blocks round robin over them. Both make a volume of
+ * jbod_num_backends() * JBOD_NUM_DISKS * JBOD_DISK_SIZE bytes. MIRRORED
+ * (RAID-1) keeps a full copy of a JBOD sized volume on every backend: writes
+ * go to all of them and reads to the least loaded one, so reads scale with
+ * the number of mirrors. */
+typedef enum {
+  MDADM_CONCAT,
+  MDADM_STRIPED,
+  MDADM_MIRRORED,
+} mdadm_layout_t;
+
+/* Return 1 on success and -1 on failure. Must be called while unmounted. */
+int mdadm_set_layout(mdadm_layout_t layout);
+
+/* Return the size of the volume in bytes. */
+uint32_t mdadm_volume_size(void);
+
+/* Return 1 on success and -1 on failure. Finds which disk and block of the
+ * volume, as used for the cache, |disk_num| and |block_num| of |backend| hold. */
+int mdadm_volume_position(int backend, uint32_t disk_num, uint32_t block_num, uint32_t *volume_disk, uint32_t *volume_block);
+
 /* Return 1 on success and -1 on failure */
 int mdadm_mount(void);
 
@@ -16,4 +41,43 @@ int mdadm_read(uint32_t addr, uint32_t len, uint8_t *buf);
 /* Return the number of bytes written on success, -1 on failure. */
 int mdadm_write(uint32_t addr, uint32_t len, const uint8_t *buf);
 
+/* Return 1 on success and -1 on failure. Turns on write combining: writes are
+ * merged per block in a buffer of up to |max_blocks| blocks and only sent to
+ * the JBOD when the buffer is full, when the oldest pending write is older than
+ * |max_age_ms| (checked on every call, <= 0 means no age limit), when a read
+ * touches a partially written block, on mdadm_flush or on unmount. Reads always
+ * see the pending writes. |max_blocks| of 0 turns it off. */
+int mdadm_write_combine(int max_blocks, int max_age_ms);
+
+/* Return 1 on success and -1 on failure. Sends all pending combined writes. */
+int mdadm_flush(void);
+
+/* Return 1 on success and -1 on failure. Must be called while unmounted.
+ * Writes held by the write-combining buffer (see mdadm_write_combine) are
+ * first appended to the journal at |path|, and only acknowledged once it is
+ * on stable storage. The journal is emptied whenever the buffer has been
+ * flushed, and what is left in it is replayed by mdadm_mount, e.g. after a
+ * crash. NULL turns the journal off. */
+int mdadm_set_journal(const char *path);
+
+/* Returns the number of the new snapshot, or -1 on failure. Takes a
+ * point-in-time copy of the volume without copying anything: the old contents
+ * of a block are only copied the first time it is overwritten after the
+ * snapshot. Snapshots are kept in memory and dropped on unmount. */
+int mdadm_snapshot_create(void);
+
+/* Return the number of bytes read on success, -1 on failure. Reads the volume
+ * as it was when |snapshot| was taken. */
+int mdadm_snapshot_read(int snapshot, uint32_t addr, uint32_t len, uint8_t *buf);
+
+/* Return 1 on success and -1 on failure. Puts in |line| (SIGCACHE_LINE_LEN
+ * bytes) the line the JBOD returns for JBOD_SIGN_BLOCK on block |block_num|
+ * of disk |disk_num| of the volume, counting the writes acknowledged so far.
+ * The line is kept until the block is written again (see sigcache.h), and a
+ * block held by the cache is signed locally, so only blocks that are in
+ * neither cost a round trip to the JBOD. Like mdadm_read and mdadm_write it
+ * must be called from one thread at a time: it looks at and flushes the
+ * write-combining buffer without a lock. */
+int mdadm_sign_block(uint32_t disk_num, uint32_t block_num, char *line);
+
 #endif
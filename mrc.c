@@ -0,0 +1,284 @@
+/* Miss ratio curve analyzer: reads a workload once and reports the hit rate an
+ * LRU cache of every size would get, instead of running the workload through
+ * tester once per -s value. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "jbod.h"
+#include "mrc.h"
+
+#define MRC_ARGUMENTS "hw:r:"
+#define USAGE                                                            \
+  "USAGE: mrc [-h] [-w workload-file] [-r sample_rate]\n"                \
+  "\n"                                                                   \
+  "where:\n"                                                             \
+  "    -h - help mode (display this message)\n"                          \
+  "    -r - only track this fraction (0, 1] of the blocks (SHARDS)\n"    \
+  "\n"                                                                   \
+
+#define NUM_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define SAMPLE_MODULUS (1 << 24)
+
+
+int mrc_load_workload(const char *path, mrc_request_t **requests)
+{
+  char line[256], cmd[32];
+  uint32_t addr, len, ch;
+  int capacity = 1024;
+  int count = 0;
+
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+  {
+    return -1;
+  }
+
+  *requests = malloc(capacity * sizeof(mrc_request_t));
+  while (fgets(line, sizeof(line), f))
+  {
+    if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4 ||
+        (strcmp(cmd, "READ") != 0 && strcmp(cmd, "WRITE") != 0) ||
+        len > 1024 || addr + len > JBOD_DISK_SIZE * JBOD_NUM_DISKS)
+    {
+      continue;  // MOUNT, UNMOUNT, SIGNALL... and requests mdadm would refuse never reach the cache
+    }
+
+    if (count == capacity)
+    {
+      capacity *= 2;
+      *requests = realloc(*requests, capacity * sizeof(mrc_request_t));
+    }
+
+    // Same split into blocks as mdadm does
+    mrc_request_t *req = &(*requests)[count++];
+    req->num_blocks = 0;
+    req->write = strcmp(cmd, "WRITE") == 0;
+    for (uint32_t curr = addr; curr < addr + len; curr = (curr / JBOD_BLOCK_SIZE + 1) * JBOD_BLOCK_SIZE)
+    {
+      bool whole = curr % JBOD_BLOCK_SIZE == 0 && addr + len - curr >= JBOD_BLOCK_SIZE;
+      req->read_on_miss[req->num_blocks] = !(req->write == true && whole == true);
+      req->blocks[req->num_blocks++] = curr / JBOD_BLOCK_SIZE;
+    }
+  }
+
+  fclose(f);
+  return count;
+}
+
+// Replays the exact sequence of cache calls mdadm makes for a request on a small LRU cache of |size| entries:
+// all the lookups first (hits become most recent), then the misses read from the device are inserted, then every
+// block is touched again in order. A write then stores all its blocks in order. Used for the sizes below
+// MRC_MAX_IO_BLOCKS, where a single request can evict its own blocks.
+static void simulate_lru(const mrc_request_t *requests, int num_requests, int size, int *hits, int *queries)
+{
+  int lru[MRC_MAX_IO_BLOCKS];  // lru[0] is the most recently used block
+  int used = 0;
+
+  *hits = 0;
+  *queries = 0;
+  if (size <= 2)
+  {
+    return;  // cache_enabled is false for 2 entries, so mdadm never uses the cache and nothing is counted
+  }
+
+  for (int r = 0; r < num_requests; r++)
+  {
+    const mrc_request_t *req = &requests[r];
+    bool hit[MRC_MAX_IO_BLOCKS];
+    bool counted = used > 0;  // cache_lookup does not count queries while the cache is empty
+
+    for (int pass = 0; pass < 4; pass++)
+    {
+      for (int i = 0; i < req->num_blocks; i++)
+      {
+        int block = req->blocks[i];
+        if ((pass == 1 && req->read_on_miss[i] == false) || (pass == 3 && req->write == false))
+        {
+          continue;
+        }
+        int pos = 0;
+        while (pos < used && lru[pos] != block)
+        {
+          pos++;
+        }
+
+        if (pass == 0)
+        {
+          hit[i] = pos < used;
+          *queries += counted ? 1 : 0;
+          *hits += counted && hit[i] ? 1 : 0;
+        }
+        if ((pass == 0 && hit[i] == false) || (pass == 1 && hit[i] == true) || (pass == 2 && pos == used))
+        {
+          continue;  // Lookups only move hits, inserts only add misses, touches only move what is there, stores do all
+        }
+        if (pos == used)
+        {
+          pos = used < size ? used++ : used - 1;  // Insert, evicting the least recently used block when full
+        }
+        memmove(&lru[1], &lru[0], pos * sizeof(int));
+        lru[0] = block;
+      }
+    }
+  }
+}
+
+// Fenwick tree over time: one mark at the time of the latest access of every tracked block, so the number of
+// marks after the previous access of a block is its LRU stack distance.
+static void bit_add(int *tree, int size, int pos, int delta)
+{
+  for (pos++; pos <= size; pos += pos & -pos)
+  {
+    tree[pos] += delta;
+  }
+}
+
+static int bit_sum(const int *tree, int pos)
+{
+  int sum = 0;
+  for (pos++; pos > 0; pos -= pos & -pos)
+  {
+    sum += tree[pos];
+  }
+  return sum;
+}
+
+static bool sampled(int block, double sample_rate)
+{
+  uint32_t h = (uint32_t) block * 2654435761u;
+  h ^= h >> 15;
+  return (h % SAMPLE_MODULUS) < sample_rate * SAMPLE_MODULUS;
+}
+
+void mrc_compute(const mrc_request_t *requests, int num_requests, double sample_rate, float *hit_rate)
+{
+  int total = 0;
+  for (int r = 0; r < num_requests; r++)
+  {
+    total += requests[r].num_blocks;
+  }
+
+  int *tree = calloc(total + 1, sizeof(int));
+  double *hist = calloc(MRC_MAX_SIZE + 1, sizeof(double));  // hist[d]: queries whose scaled stack distance is d
+  int last[NUM_BLOCKS];
+  double queries = 0;
+  int now = 0;
+  bool cache_empty = true;
+
+  for (int i = 0; i < NUM_BLOCKS; i++)
+  {
+    last[i] = -1;
+  }
+
+  // For caches of at least MRC_MAX_IO_BLOCKS entries a request never evicts its own blocks, so whether a block
+  // hits only depends on its stack distance when the request starts, and afterwards the blocks of the request
+  // are the most recent ones in request order.
+  for (int r = 0; r < num_requests; r++)
+  {
+    const mrc_request_t *req = &requests[r];
+
+    for (int i = 0; i < req->num_blocks && cache_empty == false; i++)
+    {
+      int block = req->blocks[i];
+      if (sampled(block, sample_rate) == false)
+      {
+        continue;
+      }
+      queries++;
+      if (last[block] != -1)
+      {
+        double distance = (bit_sum(tree, now - 1) - bit_sum(tree, last[block])) / sample_rate;
+        if (distance < MRC_MAX_SIZE)
+        {
+          hist[(int) distance] += 1;
+        }
+      }
+    }
+
+    for (int i = 0; i < req->num_blocks; i++)
+    {
+      int block = req->blocks[i];
+      if (sampled(block, sample_rate) == false)
+      {
+        continue;
+      }
+      if (last[block] != -1)
+      {
+        bit_add(tree, total, last[block], -1);
+      }
+      last[block] = now;
+      bit_add(tree, total, now++, 1);
+    }
+    cache_empty = cache_empty && req->num_blocks == 0;
+  }
+
+  double hits = 0;
+  for (int d = 0; d < MRC_MIN_SIZE - 1; d++)
+  {
+    hits += hist[d];
+  }
+  for (int size = MRC_MIN_SIZE; size <= MRC_MAX_SIZE; size++)
+  {
+    hits += hist[size - 1];  // A cache of |size| entries hits every query with a stack distance below |size|
+    if (size < MRC_MAX_IO_BLOCKS)
+    {
+      int small_hits, small_queries;
+      simulate_lru(requests, num_requests, size, &small_hits, &small_queries);
+      hit_rate[size] = 100 * (float) small_hits / small_queries;
+    }
+    else
+    {
+      hit_rate[size] = 100 * (float) hits / queries;
+    }
+  }
+
+  free(tree);
+  free(hist);
+}
+
+int main(int argc, char *argv[])
+{
+  int ch;
+  char *workload = NULL;
+  double sample_rate = 1.0;
+  float hit_rate[MRC_MAX_SIZE + 1];
+  mrc_request_t *requests;
+
+  while ((ch = getopt(argc, argv, MRC_ARGUMENTS)) != -1) {
+    switch (ch) {
+      case 'h':
+        fprintf(stderr, USAGE);
+        return 0;
+      case 'w':
+        workload = optarg;
+        break;
+      case 'r':
+        sample_rate = atof(optarg);
+        break;
+      default:
+        fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
+        return -1;
+    }
+  }
+
+  if (!workload || sample_rate <= 0 || sample_rate > 1) {
+    fprintf(stderr, USAGE);
+    return -1;
+  }
+
+  int num_requests = mrc_load_workload(workload, &requests);
+  if (num_requests == -1)
+    err(1, "Cannot open workload file %s", workload);
+
+  mrc_compute(requests, num_requests, sample_rate, hit_rate);
+  for (int size = MRC_MIN_SIZE; size <= MRC_MAX_SIZE; size++)
+    fprintf(stdout, "%4d Hit rate: %5.1f%%\n", size, hit_rate[size]);
+
+  free(requests);
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef MRC_H_
+#define MRC_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+
+#define MRC_MIN_SIZE 3  // cache_enabled() is false for 2 entries, the tester never uses such a cache
+#define MRC_MAX_SIZE 4096
+#define MRC_MAX_IO_BLOCKS (1024 / JBOD_BLOCK_SIZE + 1)
+
+/* The blocks one READ or WRITE of a workload touches, in order. Each block is
+ * numbered disk_num * JBOD_NUM_BLOCKS_PER_DISK + block_num. A write looks up
+ * the blocks it covers entirely but does not read (and insert) them when they
+ * miss, it only stores them afterwards. */
+typedef struct {
+  int num_blocks;
+  int blocks[MRC_MAX_IO_BLOCKS];
+  bool read_on_miss[MRC_MAX_IO_BLOCKS];
+  bool write;
+} mrc_request_t;
+
+/* Returns the number of requests read on success and -1 on failure. Parses
+ * the READ and WRITE lines of a tester workload (other lines do not touch the
+ * cache and are skipped) into a newly allocated array stored in |requests|. */
+int mrc_load_workload(const char *path, mrc_request_t **requests);
+
+/* Computes the hit rate, in percent, that cache_print_hit_rate would report
+ * for an LRU cache of every size from MRC_MIN_SIZE to MRC_MAX_SIZE, in a single
+ * pass over |requests|. |hit_rate| must have MRC_MAX_SIZE + 1 elements. When
+ * |sample_rate| is below 1, only that fraction of the blocks (chosen by
+ * hashing their number, as in SHARDS) is tracked and the stack distances are
+ * scaled up accordingly, which trades accuracy for speed on huge traces. */
+void mrc_compute(const mrc_request_t *requests, int num_requests, double sample_rate, float *hit_rate);
+
+#endif
@@ -8,11 +8,15 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "net.h"
 #include "jbod.h"
 
-/* the client socket descriptor for the connection to the server */
-int cli_sd = -1;
+/* the client socket descriptors for the connections to the servers, one per backend of the volume.
+ * cli_sd[0] is the server jbod_connect connects to. */
+int cli_sd[JBOD_MAX_BACKENDS] = { [0 ... JBOD_MAX_BACKENDS - 1] = -1 };
+static int num_backends = 0;
 
 /* attempts to read n (len) bytes from fd; returns true on success and false on failure. 
 It may need to call the system call "read" multiple times to reach the given size len. 
@@ -26,9 +30,9 @@ static bool nread(int fd, int len, uint8_t *buf) {
   {
     int size_to_read = len - read_so_far;  // Knowing how how much needs to be read per loop 
     content_to_read = read(fd, buf + read_so_far, size_to_read);
-    if(content_to_read < 0)
+    if(content_to_read <= 0)
     {
-      return false; // there was a failure in reading 
+      return false; // there was a failure in reading, or the connection was closed or shut down
     }
     read_so_far += content_to_read; // We increment based on how much was actually read
   }
@@ -46,7 +50,8 @@ static bool nwrite(int fd, int len, uint8_t *buf) {    // Function is similar to
   while(written_so_far < len)
   {
     int size_to_write = len - written_so_far;
-    content_to_write = write(fd, buf + written_so_far, size_to_write);
+    // MSG_NOSIGNAL: a connection the peer closed or jbod_backend_shutdown shut down fails the write instead of raising SIGPIPE
+    content_to_write = send(fd, buf + written_so_far, size_to_write, MSG_NOSIGNAL);
     if(content_to_write < 0)
     {
       return false; // If calling the system call "write" fails 
@@ -164,16 +169,19 @@ static bool send_packet(int sd, uint32_t op, uint8_t *block) {
 
 
 
-/* attempts to connect to server and set the global cli_sd variable to the
- * socket; returns true if successful and false if not. 
- * this function will be invoked by tester to connect to the server at given ip and port.
- * you will not call it in mdadm.c
+/* attempts to connect to the server at ip and port as backend number |backend| of the volume
+ * and stores the socket in cli_sd[backend]; returns true if successful and false if not. 
 */
-bool jbod_connect(const char *ip, uint16_t port) {
+bool jbod_connect_backend(int backend, const char *ip, uint16_t port) {
+
+  if (backend < 0 || backend >= JBOD_MAX_BACKENDS || cli_sd[backend] != -1)
+  {
+    return false;
+  }
 
-  cli_sd = socket(AF_INET, SOCK_STREAM,0); // Creating the socket 
+  int sd = socket(AF_INET, SOCK_STREAM,0); // Creating the socket 
 
-  if(cli_sd == -1)
+  if(sd == -1)
   {
     return false; // This is if creating the socket fails.
 
@@ -183,66 +191,148 @@ bool jbod_connect(const char *ip, uint16_t port) {
   server_addr.sin_family = AF_INET;
   server_addr.sin_port = htons(port);
 
-  if( inet_pton(AF_INET, ip, &server_addr.sin_addr) == 0) // Getting the IPv6 address in binary 
+  if( inet_pton(AF_INET, ip, &server_addr.sin_addr) != 1) // Getting the IPv4 address in binary 
   {
+    close(sd);
     return false;
   }
 
-  if(connect(cli_sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) // Here is when we actually try to connect to the server 
+  if(connect(sd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) // Here is when we actually try to connect to the server 
   {
+    close(sd);
     return false; // if connecting to the server fails
   }
 
+  // Requests are pipelined, so small packets must not wait behind the ACK of the previous one (Nagle)
+  int nodelay = 1;
+  setsockopt(sd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+  cli_sd[backend] = sd;
+  if (backend >= num_backends)
+  {
+    num_backends = backend + 1;
+  }
   return true; // A successful jbod connect
 
 }
 
+/* attempts to connect to server and set cli_sd[0] to the socket; returns true if successful and false if not. 
+ * this function will be invoked by tester to connect to the server at given ip and port.
+ * you will not call it in mdadm.c
+*/
+bool jbod_connect(const char *ip, uint16_t port) {
+  return jbod_connect_backend(0, ip, port);
+}
+
+/* shuts the connection to the server of |backend| down in both directions, so a thread blocked
+sending or receiving on it returns with a failure. The socket stays in cli_sd until jbod_disconnect. */
+void jbod_backend_shutdown(int backend) {
 
+  if (backend >= 0 && backend < JBOD_MAX_BACKENDS && cli_sd[backend] != -1)
+  {
+    shutdown(cli_sd[backend], SHUT_RDWR);
+  }
+}
+
+/* returns how many backends the volume has, i.e. one past the highest connected backend */
+int jbod_num_backends(void) {
+  return num_backends;
+}
 
 
-/* disconnects from the server and resets cli_sd */
+/* disconnects from all the servers and resets cli_sd */
 void jbod_disconnect(void) {
 
-  if(cli_sd != -1)
+  for (int i = 0; i < JBOD_MAX_BACKENDS; i++)
   {
-    close(cli_sd);
-    cli_sd = -1;
+    if(cli_sd[i] != -1)
+    {
+      close(cli_sd[i]);
+      cli_sd[i] = -1;
+    }
   }
+  num_backends = 0;
 }
 
 
 
-/* sends the JBOD operation to the server (use the send_packet function) and receives 
+/* sends the JBOD operation to the server of |backend| (use the send_packet function) and receives 
 (use the recv_packet function) and processes the response. 
 
 The meaning of each parameter is the same as in the original jbod_operation function. 
 return: 0 means success, -1 means failure.
 */
-int jbod_client_operation(uint32_t op, uint8_t *block) {
+int jbod_backend_operation(int backend, uint32_t op, uint8_t *block) {
 
-  if( cli_sd == -1)
+  if (jbod_backend_send(backend, op, block) == false)
   {
-    return -1; // make sure we are connected to the server
+    return -1;
   }
 
-  // Sends the JBOD operation to the server
-  if( send_packet(cli_sd, op, block) == false)
+  uint32_t response_op;
+  if (jbod_backend_recv(backend, &response_op, block) == -1 || response_op != op)
   {
     return -1;
   }
 
-  // receive and process the response from the server
+  return 0;
+}
+
+/* same as jbod_backend_operation, on the server jbod_connect connected to */
+int jbod_client_operation(uint32_t op, uint8_t *block) {
+  return jbod_backend_operation(0, op, block);
+}
+
+
+
+/* Pipelined version of jbod_backend_operation, split in its two halves. The client may
+send several requests with jbod_backend_send before collecting the responses, in the same 
+order, with jbod_backend_recv. This hides the round trip when many independent operations
+are issued back to back (e.g. signing every block of the device).
+
+jbod_backend_send returns true on success and false on failure.
+jbod_backend_recv stores the opcode of the response in op and returns 0 on success, -1 on failure.
+*/
+bool jbod_backend_send(int backend, uint32_t op, uint8_t *block) {
+
+  if (backend < 0 || backend >= JBOD_MAX_BACKENDS || cli_sd[backend] == -1)
+  {
+    return false; // make sure we are connected to the server
+  }
+
+  return send_packet(cli_sd[backend], op, block);
+}
+
+int jbod_backend_recv(int backend, uint32_t *op, uint8_t *block) {
+
   uint16_t response_return;
-  uint32_t response_op;
 
-  if( recv_packet(cli_sd, &response_op, &response_return, block) == false)
+  if (backend < 0 || backend >= JBOD_MAX_BACKENDS || cli_sd[backend] == -1)
   {
     return -1;
   }
-  if (response_op != op || response_return == -1)
+
+  // The server answers with small writes and holds the next response until this one is acknowledged (Nagle),
+  // so acknowledge right away instead of waiting for the delayed ACK. Linux clears this after every ACK.
+  int quickack = 1;
+  setsockopt(cli_sd[backend], IPPROTO_TCP, TCP_QUICKACK, &quickack, sizeof(quickack));
+
+  if (recv_packet(cli_sd[backend], op, &response_return, block) == false)
+  {
+    return -1;
+  }
+  if (response_return == (uint16_t) -1)
   {
     return -1;
   }
 
   return 0;
 }
+
+bool jbod_client_send(uint32_t op, uint8_t *block) {
+  return jbod_backend_send(0, op, block);
+}
+
+int jbod_client_recv(uint32_t *op, uint8_t *block) {
+  return jbod_backend_recv(0, op, block);
+}
@@ -4,12 +4,31 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include "jbod.h"
+
 #define HEADER_LEN (sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t))
 #define JBOD_SERVER "127.0.0.1"
 #define JBOD_PORT 3333
+#define JBOD_MAX_BACKENDS 8
+
+/* Protocol extension, not part of jbod_cmd_t: behaves like JBOD_WRITE_BLOCK of
+ * a block filled with the byte in bits 0-7 of the op, but the request is only
+ * a header. Servers that do not know it answer with an error and nothing else
+ * happens, so the client can fall back to JBOD_WRITE_BLOCK. */
+#define JBOD_WRITE_SAME JBOD_NUM_CMDS
 
 int jbod_client_operation(uint32_t op, uint8_t *block);
 bool jbod_connect(const char *ip, uint16_t port);
 void jbod_disconnect(void);
 
+bool jbod_client_send(uint32_t op, uint8_t *block);
+int jbod_client_recv(uint32_t *op, uint8_t *block);
+
+bool jbod_connect_backend(int backend, const char *ip, uint16_t port);
+int jbod_num_backends(void);
+int jbod_backend_operation(int backend, uint32_t op, uint8_t *block);
+bool jbod_backend_send(int backend, uint32_t op, uint8_t *block);
+int jbod_backend_recv(int backend, uint32_t *op, uint8_t *block);
+void jbod_backend_shutdown(int backend);
+
 #endif
@@ -0,0 +1,429 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "jbod.h"
+#include "net.h"
+#include "sched.h"
+#include "util.h"
+
+// One queued block operation
+typedef struct {
+  jbod_cmd_t cmd;
+  uint32_t disk_num;
+  uint32_t block_num;
+  uint8_t *block;
+  int expire;   // Dispatch count after which the request is overdue (deadline policy)
+} sched_request_t;
+
+// One JBOD operation on the wire, seeks included
+typedef struct {
+  uint32_t op;
+  uint8_t *block;
+  const sched_request_t *fill_of;  // For JBOD_WRITE_SAME, the write it stands for
+  bool probe;                      // First JBOD_WRITE_SAME sent to a server that may not know it
+} sched_op_t;
+
+// Whether the server of a backend understands JBOD_WRITE_SAME, which is only known after trying
+typedef enum {
+  WRITE_SAME_UNKNOWN,
+  WRITE_SAME_SUPPORTED,
+  WRITE_SAME_UNSUPPORTED,
+} write_same_t;
+
+// Each backend has its own queue and its own head, and is dispatched independently of the others
+typedef struct {
+  sched_request_t queue[SCHED_MAX_REQUESTS];
+  int queue_len;
+
+  // Where the JBOD head is. Reads and writes move it to the next block of the same disk.
+  bool position_known;
+  uint32_t head_disk;
+  uint32_t head_block;
+
+  int dispatched;
+  long seeks_issued;
+  long seeks_naive;  // Two seeks per request, what dispatching in order without tracking the head costs
+  int rc;            // Result of the last run
+  long request_us;   // Moving average of the time one request takes, as observed while dispatching
+
+  write_same_t write_same;
+  long uniform_writes;  // Writes of a block that is one byte repeated
+  long fills;           // Those of them sent as JBOD_WRITE_SAME
+} sched_backend_t;
+
+static sched_backend_t backends[JBOD_MAX_BACKENDS];
+static sched_policy_t policy = SCHED_FIFO;
+
+
+static long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+static uint32_t key_of(const sched_request_t *req)
+{
+  return req->disk_num * JBOD_NUM_BLOCKS_PER_DISK + req->block_num;
+}
+
+int sched_set_policy(sched_policy_t new_policy)
+{
+  if (new_policy < SCHED_FIFO || new_policy > SCHED_DEADLINE || sched_run() == -1)
+  {
+    return -1;
+  }
+  policy = new_policy;
+  return 1;
+}
+
+int sched_parse_policy(const char *name, sched_policy_t *parsed)
+{
+  if (strcmp(name, "fifo") == 0)
+  {
+    *parsed = SCHED_FIFO;
+  }
+  else if (strcmp(name, "elevator") == 0)
+  {
+    *parsed = SCHED_ELEVATOR;
+  }
+  else if (strcmp(name, "deadline") == 0)
+  {
+    *parsed = SCHED_DEADLINE;
+  }
+  else
+  {
+    return -1;
+  }
+  return 1;
+}
+
+void sched_reset_position(void)
+{
+  for (int b = 0; b < JBOD_MAX_BACKENDS; b++)
+  {
+    backends[b].position_known = false;
+    backends[b].write_same = WRITE_SAME_UNKNOWN;  // The server may not be the same one after a reconnect
+  }
+}
+
+int sched_submit(int backend, jbod_cmd_t cmd, uint32_t disk_num, uint32_t block_num, uint8_t *block)
+{
+  if (backend < 0 || backend >= JBOD_MAX_BACKENDS || (cmd != JBOD_READ_BLOCK && cmd != JBOD_WRITE_BLOCK) ||
+      disk_num >= JBOD_NUM_DISKS || block_num >= JBOD_NUM_BLOCKS_PER_DISK || block == NULL)
+  {
+    return -1;
+  }
+
+  sched_backend_t *be = &backends[backend];
+  if (be->queue_len == SCHED_MAX_REQUESTS && sched_run() == -1)
+  {
+    return -1;
+  }
+
+  sched_request_t *req = &be->queue[be->queue_len++];
+  req->cmd = cmd;
+  req->disk_num = disk_num;
+  req->block_num = block_num;
+  req->block = block;
+  req->expire = be->dispatched + (cmd == JBOD_READ_BLOCK ? SCHED_READ_EXPIRE : SCHED_WRITE_EXPIRE);
+  return 1;
+}
+
+// Picks the next request for the elevator: the first one at or after the head going upwards (lowest arrival
+// order for the same block), wrapping around to the lowest block when there is nothing left above the head.
+static int pick_elevator(const sched_backend_t *be, const bool *done)
+{
+  uint32_t head = be->position_known == true ? be->head_disk * JBOD_NUM_BLOCKS_PER_DISK + be->head_block : 0;
+  int best_above = -1;
+  int best_any = -1;
+
+  for (int i = 0; i < be->queue_len; i++)
+  {
+    if (done[i] == true)
+    {
+      continue;
+    }
+    uint32_t key = key_of(&be->queue[i]);
+    if (key >= head && (best_above == -1 || key < key_of(&be->queue[best_above])))
+    {
+      best_above = i;
+    }
+    if (best_any == -1 || key < key_of(&be->queue[best_any]))
+    {
+      best_any = i;
+    }
+  }
+  return best_above != -1 ? best_above : best_any;
+}
+
+// Deadline: the overdue request that expired first if there is one, the elevator's choice otherwise. Requests
+// to the same block must keep their order, so an overdue request yields to older ones on its block.
+static int pick_deadline(const sched_backend_t *be, const bool *done)
+{
+  int overdue = -1;
+
+  for (int i = 0; i < be->queue_len; i++)
+  {
+    if (done[i] == false && be->dispatched >= be->queue[i].expire &&
+        (overdue == -1 || be->queue[i].expire < be->queue[overdue].expire))
+    {
+      overdue = i;
+    }
+  }
+  if (overdue == -1)
+  {
+    return pick_elevator(be, done);
+  }
+
+  for (int i = 0; i < overdue; i++)
+  {
+    if (done[i] == false && key_of(&be->queue[i]) == key_of(&be->queue[overdue]))
+    {
+      return i;
+    }
+  }
+  return overdue;
+}
+
+// Turns one request into the operations to send, seeking only when the head is not already on its block
+static int plan_request(sched_backend_t *be, const sched_request_t *req, sched_op_t *ops, bool *probe_planned)
+{
+  int n = 0;
+
+  be->seeks_naive += 2;
+  if (be->position_known == false || be->head_disk != req->disk_num)
+  {
+    ops[n++] = (sched_op_t) { req->disk_num << 28 | JBOD_SEEK_TO_DISK << 14, NULL, NULL, false };
+    be->head_disk = req->disk_num;
+    be->position_known = false;  // The block is not known until we seek to it
+  }
+  if (be->position_known == false || be->head_block != req->block_num)
+  {
+    ops[n++] = (sched_op_t) { req->block_num << 20 | JBOD_SEEK_TO_BLOCK << 14, NULL, NULL, false };
+    be->head_block = req->block_num;
+    be->position_known = true;
+  }
+  be->seeks_issued += n;
+
+  ops[n] = (sched_op_t) { req->cmd << 14, req->block, NULL, false };
+  if (req->cmd == JBOD_WRITE_BLOCK && block_is_uniform(req->block, JBOD_BLOCK_SIZE) == true)
+  {
+    // Only the byte goes on the wire. Until the server has accepted one fill, a single one is sent per run (the
+    // probe) and the other uniform blocks of the run go as plain writes.
+    be->uniform_writes++;
+    if (be->write_same == WRITE_SAME_SUPPORTED || (be->write_same == WRITE_SAME_UNKNOWN && *probe_planned == false))
+    {
+      ops[n] = (sched_op_t) { JBOD_WRITE_SAME << 14 | req->block[0], NULL, req, be->write_same == WRITE_SAME_UNKNOWN };
+      *probe_planned = *probe_planned || ops[n].probe;
+    }
+  }
+  n++;
+  be->dispatched++;
+
+  // The JBOD moves on to the next block after reading or writing. What happens past the last block of a disk
+  // is not something we rely on, so the head is considered lost there.
+  be->head_block++;
+  if (be->head_block == JBOD_NUM_BLOCKS_PER_DISK)
+  {
+    be->position_known = false;
+  }
+  return n;
+}
+
+// Writes one block the plain way, seeking to it first, without going through the pipeline
+static int write_block(sched_backend_t *be, const sched_request_t *req)
+{
+  int backend = be - backends;
+
+  be->seeks_issued += 2;
+  if (jbod_backend_operation(backend, req->disk_num << 28 | JBOD_SEEK_TO_DISK << 14, NULL) == -1 ||
+      jbod_backend_operation(backend, req->block_num << 20 | JBOD_SEEK_TO_BLOCK << 14, NULL) == -1 ||
+      jbod_backend_operation(backend, JBOD_WRITE_BLOCK << 14, req->block) == -1)
+  {
+    return -1;
+  }
+  return 0;
+}
+
+// Dispatches the queue of one backend. The order and the seeks do not depend on the responses, so the whole
+// sequence is pipelined with up to SCHED_PIPELINE_DEPTH operations in flight.
+static void *run_backend(void *arg)
+{
+  sched_backend_t *be = arg;
+  int backend = be - backends;
+  sched_op_t ops[3 * SCHED_MAX_REQUESTS];
+  bool done[SCHED_MAX_REQUESTS];
+  int num_ops = 0;
+  bool probe_planned = false;
+
+  memset(done, 0, sizeof(done));
+  for (int n = 0; n < be->queue_len; n++)
+  {
+    int next = n;
+    if (policy == SCHED_ELEVATOR)
+    {
+      next = pick_elevator(be, done);
+    }
+    else if (policy == SCHED_DEADLINE)
+    {
+      next = pick_deadline(be, done);
+    }
+
+    done[next] = true;
+    num_ops += plan_request(be, &be->queue[next], &ops[num_ops], &probe_planned);
+  }
+
+  be->rc = 1;
+  int requests = be->queue_len;
+  long start_us = now_us();
+  int sent = 0;
+  bool probing = false;  // The pipeline stops behind a probe until we know whether the server took it
+  for (int received = 0; received < num_ops; received++)
+  {
+    while (sent < num_ops && sent - received < SCHED_PIPELINE_DEPTH && probing == false)
+    {
+      if (jbod_backend_send(backend, ops[sent].op, ops[sent].block) == false)
+      {
+        be->rc = -1;
+        num_ops = sent;  // Nothing more goes out, we only collect what is already on its way
+        break;
+      }
+      probing = ops[sent++].probe;
+    }
+    if (received == num_ops)
+    {
+      break;
+    }
+
+    uint32_t op;
+    int rc = jbod_backend_recv(backend, &op, ops[received].block);
+    if (ops[received].probe == true)
+    {
+      probing = false;
+      if (rc == 0 && op == ops[received].op)
+      {
+        be->write_same = WRITE_SAME_SUPPORTED;
+      }
+      else if (op == ops[received].op)
+      {
+        // The server turned the fill down without doing anything, so the block goes out as a plain write. That
+        // leaves the head right after the block, as the rest of the plan expects.
+        be->write_same = WRITE_SAME_UNSUPPORTED;
+        rc = write_block(be, ops[received].fill_of);
+      }
+    }
+    if (rc == -1 || op != ops[received].op)
+    {
+      // A failed seek leaves the head somewhere else, so a read or write planned after it would hit another block.
+      // Like a failed send, nothing more goes out and we only collect what is already on its way.
+      be->rc = -1;
+      num_ops = sent;
+    }
+    else if (ops[received].fill_of != NULL && be->write_same == WRITE_SAME_SUPPORTED)
+    {
+      be->fills++;
+    }
+  }
+
+  if (be->rc == -1)
+  {
+    be->position_known = false;
+  }
+  else
+  {
+    // Each run counts for 1/8th of the average, so a server that slows down is noticed after a few batches
+    long sample_us = (now_us() - start_us) / requests;
+    be->request_us = be->request_us == 0 ? sample_us : (7 * be->request_us + sample_us) / 8;
+  }
+  be->queue_len = 0;
+  return NULL;
+}
+
+long sched_backend_load(int backend)
+{
+  if (backend < 0 || backend >= JBOD_MAX_BACKENDS)
+  {
+    return -1;
+  }
+  sched_backend_t *be = &backends[backend];
+  return (be->queue_len + 1) * (be->request_us > 0 ? be->request_us : 1);
+}
+
+int sched_run(void)
+{
+  pthread_t threads[JBOD_MAX_BACKENDS];
+  bool busy[JBOD_MAX_BACKENDS];
+  bool threaded[JBOD_MAX_BACKENDS];
+  int last = -1;
+  int rc = 1;
+
+  for (int b = 0; b < JBOD_MAX_BACKENDS; b++)
+  {
+    busy[b] = backends[b].queue_len > 0;
+    threaded[b] = false;
+    if (busy[b] == true)
+    {
+      last = b;
+    }
+  }
+
+  // Every backend with work but the last one gets a thread and the last one is run here, so the backends are
+  // driven concurrently. With one backend (the usual case) no thread is created at all.
+  for (int b = 0; b < last; b++)
+  {
+    if (busy[b] == true)
+    {
+      threaded[b] = pthread_create(&threads[b], NULL, run_backend, &backends[b]) == 0;
+      if (threaded[b] == false)
+      {
+        run_backend(&backends[b]);
+      }
+    }
+  }
+  if (last != -1)
+  {
+    run_backend(&backends[last]);
+  }
+
+  for (int b = 0; b <= last; b++)
+  {
+    if (threaded[b] == true)
+    {
+      pthread_join(threads[b], NULL);
+    }
+    if (busy[b] == true && backends[b].rc == -1)
+    {
+      rc = -1;
+    }
+  }
+  return rc;
+}
+
+void sched_print_stats(void)
+{
+  long issued = 0;
+  long naive = 0;
+
+  for (int b = 0; b < JBOD_MAX_BACKENDS; b++)
+  {
+    issued += backends[b].seeks_issued;
+    naive += backends[b].seeks_naive;
+  }
+  fprintf(stderr, "Seeks: %ld issued, %ld saved\n", issued, naive - issued);
+
+  long uniform = 0;
+  long fills = 0;
+  for (int b = 0; b < JBOD_MAX_BACKENDS; b++)
+  {
+    uniform += backends[b].uniform_writes;
+    fills += backends[b].fills;
+  }
+  if (uniform > 0)
+  {
+    fprintf(stderr, "Fills: %ld of %ld uniform block writes\n", fills, uniform);
+  }
+}
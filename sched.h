@@ -0,0 +1,60 @@
+#ifndef SCHED_H_
+#define SCHED_H_
+
+#include <stdint.h>
+
+#include "jbod.h"
+
+#define SCHED_MAX_REQUESTS 512
+#define SCHED_READ_EXPIRE 16    // Requests a read may be passed over by before it must be served (deadline)
+#define SCHED_WRITE_EXPIRE 64   // Same for writes, which nobody is waiting on as urgently
+#define SCHED_PIPELINE_DEPTH 32 // JBOD operations in flight per backend
+
+typedef enum {
+  SCHED_FIFO,
+  SCHED_ELEVATOR,
+  SCHED_DEADLINE,
+} sched_policy_t;
+
+/* Returns 1 on success and -1 on failure. Chooses the order in which sched_run
+ * dispatches the queued requests: FIFO keeps the arrival order, ELEVATOR sweeps
+ * upwards through (disk, block) from the current head position and wraps
+ * around, DEADLINE works like ELEVATOR but serves a request first once it has
+ * been passed over by SCHED_READ_EXPIRE (SCHED_WRITE_EXPIRE for writes)
+ * others. Requests to the same block are always dispatched in arrival order. */
+int sched_set_policy(sched_policy_t policy);
+
+/* Returns 1 on success and -1 on failure. Parses "fifo", "elevator" or
+ * "deadline" into |policy|. */
+int sched_parse_policy(const char *name, sched_policy_t *policy);
+
+/* Returns 1 on success and -1 on failure. Queues a JBOD_READ_BLOCK or
+ * JBOD_WRITE_BLOCK of |disk_num| and |block_num| on the JBOD of |backend|.
+ * |block| must stay valid until sched_run returns. If the queue of the backend
+ * is full everything queued is run first. Writes of a block that is one byte
+ * repeated are sent as JBOD_WRITE_SAME when the server supports it. */
+int sched_submit(int backend, jbod_cmd_t cmd, uint32_t disk_num, uint32_t block_num, uint8_t *block);
+
+/* Returns how long, in microseconds, a request queued now on |backend| would
+ * take to be served: the requests already queued plus this one, times the
+ * average time per request observed on that backend (1us until it has been
+ * measured, so untried backends are compared by queue depth). -1 if |backend|
+ * is out of range. */
+long sched_backend_load(int backend);
+
+/* Returns 1 on success and -1 on failure. Dispatches every queued request,
+ * only seeking when the JBOD is not already positioned on the block. Each
+ * backend has its own queue and head position; the operations of a backend
+ * are pipelined, and backends with work are driven concurrently. */
+int sched_run(void);
+
+/* Forgets where the JBODs are positioned, e.g. after a mount, and whether
+ * their servers support JBOD_WRITE_SAME. */
+void sched_reset_position(void);
+
+/* Prints how many seeks were issued and how many were saved compared with
+ * seeking before every block in arrival order, and how many uniform block
+ * writes went out as JBOD_WRITE_SAME. */
+void sched_print_stats(void);
+
+#endif
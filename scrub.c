@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "jbod.h"
+#include "mdadm.h"
+#include "net.h"
+#include "scrub.h"
+#include "sigcache.h"
+#include "util.h"
+
+typedef char sig_line_t[JBOD_BLOCK_SIZE];
+
+// Everything the threads of one scan share. Each thread only writes its own slots.
+typedef struct {
+  bool *cached;                 // cached[i] is true if the cache holds block i
+  uint8_t (*blocks)[JBOD_BLOCK_SIZE];  // contents of the cached blocks
+  sig_line_t *local_sigs;      // signatures computed from blocks
+  int first;                    // range of blocks a signing thread works on
+  int last;
+  int backend;
+  bool send_failed;
+} scrub_job_t;
+
+static uint32_t sign_op(int block)
+{
+  int disk_num = block / JBOD_NUM_BLOCKS_PER_DISK;
+  int block_num = block % JBOD_NUM_BLOCKS_PER_DISK;
+  return disk_num << 28 | block_num << 20 | JBOD_SIGN_BLOCK << 14;
+}
+
+// Sender half of the stream, the responses are read by scrub_device while this is still writing
+static void *send_requests(void *arg)
+{
+  scrub_job_t *job = arg;
+
+  for (int i = 0; i < SCRUB_NUM_BLOCKS; i++)
+  {
+    if (jbod_backend_send(job->backend, sign_op(i), NULL) == false)
+    {
+      job->send_failed = true;
+      jbod_backend_shutdown(job->backend);  // Wakes the reader, the responses it waits for will not come
+      break;
+    }
+  }
+  return NULL;
+}
+
+// Signs the cached blocks in [first, last) with the thread safe signature routine
+static void *sign_local(void *arg)
+{
+  scrub_job_t *job = arg;
+
+  for (int i = job->first; i < job->last; i++)
+  {
+    if (job->cached[i] == true)
+    {
+      format_block_sig(i / JBOD_NUM_BLOCKS_PER_DISK, i % JBOD_NUM_BLOCKS_PER_DISK, job->blocks[i],
+                       job->local_sigs[i], sizeof(sig_line_t));
+    }
+  }
+  return NULL;
+}
+
+// Scans one backend of the volume, see scrub_device
+static int scrub_backend(int backend, int num_threads, FILE *out)
+{
+  sig_line_t *server_sigs = malloc(SCRUB_NUM_BLOCKS * sizeof(sig_line_t));
+  sig_line_t *local_sigs = malloc(SCRUB_NUM_BLOCKS * sizeof(sig_line_t));
+  uint8_t (*blocks)[JBOD_BLOCK_SIZE] = malloc(SCRUB_NUM_BLOCKS * JBOD_BLOCK_SIZE);
+  bool *cached = calloc(SCRUB_NUM_BLOCKS, sizeof(bool));
+  uint32_t *volume_blocks = malloc(SCRUB_NUM_BLOCKS * sizeof(uint32_t));
+  uint32_t *generations = malloc(SCRUB_NUM_BLOCKS * sizeof(uint32_t));
+  scrub_job_t *jobs = calloc(num_threads + 1, sizeof(scrub_job_t));
+  pthread_t *threads = malloc((num_threads + 1) * sizeof(pthread_t));
+  int mismatches = 0;
+  bool failed = false;
+
+  // Take a copy of what the cache holds first, the cache itself is not thread safe. The generations are read
+  // before the blocks are signed, as sigcache_fill expects.
+  for (int i = 0; i < SCRUB_NUM_BLOCKS; i++)
+  {
+    uint32_t volume_disk, volume_block;
+    volume_blocks[i] = SIGCACHE_NUM_BLOCKS;  // Out of range, sigcache_fill ignores it
+    if (mdadm_volume_position(backend, i / JBOD_NUM_BLOCKS_PER_DISK, i % JBOD_NUM_BLOCKS_PER_DISK,
+                              &volume_disk, &volume_block) == 1)
+    {
+      volume_blocks[i] = volume_disk * JBOD_NUM_BLOCKS_PER_DISK + volume_block;
+      generations[i] = sigcache_generation(volume_blocks[i]);
+      cached[i] = cache_enabled() == true && cache_peek(volume_disk, volume_block, blocks[i]) == 1;
+    }
+  }
+
+  for (int t = 0; t <= num_threads; t++)
+  {
+    jobs[t].cached = cached;
+    jobs[t].blocks = blocks;
+    jobs[t].local_sigs = local_sigs;
+    jobs[t].first = (int) ((long) t * SCRUB_NUM_BLOCKS / num_threads);
+    jobs[t].last = (int) ((long) (t + 1) * SCRUB_NUM_BLOCKS / num_threads);
+    jobs[t].backend = backend;
+  }
+
+  // jobs[num_threads] belongs to the sender, the others to the signing threads
+  bool sending = pthread_create(&threads[num_threads], NULL, send_requests, &jobs[num_threads]) == 0;
+  bool *signing = calloc(num_threads, sizeof(bool));
+  for (int t = 0; t < num_threads && signing != NULL; t++)
+  {
+    signing[t] = pthread_create(&threads[t], NULL, sign_local, &jobs[t]) == 0;
+  }
+
+  for (int i = 0; i < SCRUB_NUM_BLOCKS && sending == true; i++)
+  {
+    uint32_t op;
+    if (jbod_backend_recv(backend, &op, (uint8_t *) server_sigs[i]) == -1 || op != sign_op(i))
+    {
+      // The sender may be blocked on a full socket, shut it down so it can be joined. The stream is
+      // out of step with the requests now, so the connection is of no further use anyway.
+      jbod_backend_shutdown(backend);
+      failed = true;
+      break;
+    }
+    server_sigs[i][JBOD_BLOCK_SIZE - 1] = '\0';
+  }
+  failed = failed || sending == false;
+
+  if (sending == true)
+  {
+    pthread_join(threads[num_threads], NULL);
+  }
+  for (int t = 0; t < num_threads; t++)
+  {
+    if (signing != NULL && signing[t] == true)
+    {
+      pthread_join(threads[t], NULL);
+    }
+    else if (failed == false)
+    {
+      sign_local(&jobs[t]);  // No thread for this range, sign it here
+    }
+  }
+  free(signing);
+
+  failed = failed || jobs[num_threads].send_failed;
+  if (failed == false)
+  {
+    for (int i = 0; i < SCRUB_NUM_BLOCKS; i++)
+    {
+      if (cached[i] == true && strcmp(server_sigs[i], local_sigs[i]) != 0)
+      {
+        fprintf(stderr, "scrub: backend %d disk %d block %d does not match the cached copy\n",
+                backend, i / JBOD_NUM_BLOCKS_PER_DISK, i % JBOD_NUM_BLOCKS_PER_DISK);
+        mismatches++;
+      }
+      else
+      {
+        // Lines are only ever kept, never served here: a kept line would hide the device drifting from what was
+        // written, which is what the scan is for. A later mdadm_sign_block of the block is spared the round trip.
+        sigcache_fill(volume_blocks[i], generations[i], server_sigs[i]);
+      }
+      if (out != NULL)
+      {
+        fprintf(out, "%s", server_sigs[i]);
+      }
+    }
+  }
+
+  free(server_sigs);
+  free(local_sigs);
+  free(blocks);
+  free(cached);
+  free(volume_blocks);
+  free(generations);
+  free(jobs);
+  free(threads);
+
+  return failed == true ? -1 : mismatches;
+}
+
+int scrub_device(int num_threads, FILE *out)
+{
+  int mismatches = 0;
+
+  if (num_threads < 1)
+  {
+    num_threads = 1;
+  }
+
+  for (int backend = 0; backend < jbod_num_backends(); backend++)
+  {
+    int rc = scrub_backend(backend, num_threads, out);
+    if (rc == -1)
+    {
+      return -1;
+    }
+    mismatches += rc;
+  }
+  return mismatches;
+}
@@ -0,0 +1,28 @@
+#ifndef SCRUB_H_
+#define SCRUB_H_
+
+#include <stdio.h>
+
+#include "jbod.h"
+
+#define SCRUB_NUM_BLOCKS (JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define SCRUB_THREADS 4
+
+/* Returns the number of blocks whose signature from the server does not match
+ * the one computed locally, or -1 on failure. Every block of every backend is
+ * signed, one backend after the other, each over one pipelined stream: a
+ * helper thread sends all the JBOD_SIGN_BLOCK requests of the backend while
+ * the caller reads the responses back. Blocks
+ * held in the cache are signed locally by |num_threads| threads meanwhile and
+ * each mismatch is reported on stderr. If |out| is not NULL the server's
+ * signature lines are written to it in device order. A failure in the middle
+ * of a stream shuts the connection to that backend down, since the responses
+ * still in flight would be taken for those of later requests.
+ *
+ * The signature cache (sigcache.h) is never consulted, every line comes from
+ * the device, since catching the device drifting from what was written is
+ * the point of the scan. The lines of blocks that match are kept in it for
+ * mdadm_sign_block. Pending writes must be flushed first (mdadm_flush). */
+int scrub_device(int num_threads, FILE *out);
+
+#endif
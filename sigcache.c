@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "sigcache.h"
+
+typedef struct {
+  uint32_t generation;  // Generation of the block the line was computed for
+  bool valid;
+  char line[SIGCACHE_LINE_LEN];
+} sig_entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t generations[SIGCACHE_NUM_BLOCKS];
+static sig_entry_t *entries = NULL;  // Allocated on the first store, most runs never sign a block
+
+static long num_requests = 0;
+static long num_hits = 0;
+static long num_from_device = 0;
+
+
+uint32_t sigcache_generation(uint32_t block)
+{
+  pthread_mutex_lock(&lock);
+  uint32_t generation = block < SIGCACHE_NUM_BLOCKS ? generations[block] : 0;
+  pthread_mutex_unlock(&lock);
+  return generation;
+}
+
+void sigcache_invalidate(uint32_t block)
+{
+  if (block >= SIGCACHE_NUM_BLOCKS)
+  {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  generations[block]++;  // Nothing to clear, the entry no longer matches
+  pthread_mutex_unlock(&lock);
+}
+
+int sigcache_lookup(uint32_t block, char *line)
+{
+  int rc = -1;
+
+  if (block >= SIGCACHE_NUM_BLOCKS || line == NULL)
+  {
+    return -1;
+  }
+
+  pthread_mutex_lock(&lock);
+  num_requests++;
+  if (entries != NULL && entries[block].valid == true && entries[block].generation == generations[block])
+  {
+    num_hits++;
+    memcpy(line, entries[block].line, SIGCACHE_LINE_LEN);
+    rc = 1;
+  }
+  pthread_mutex_unlock(&lock);
+  return rc;
+}
+
+// Keeps |line| unless the block was written since |generation| was read, called with the lock held
+static void keep_line(uint32_t block, uint32_t generation, const char *line)
+{
+  if (entries == NULL)
+  {
+    entries = calloc(SIGCACHE_NUM_BLOCKS, sizeof(sig_entry_t));
+  }
+  // A write that raced with the signing makes the line stale before it is even stored
+  if (entries != NULL && generation == generations[block])
+  {
+    entries[block].generation = generation;
+    entries[block].valid = true;
+    strncpy(entries[block].line, line, SIGCACHE_LINE_LEN - 1);
+    entries[block].line[SIGCACHE_LINE_LEN - 1] = '\0';
+  }
+}
+
+void sigcache_store(uint32_t block, uint32_t generation, const char *line, bool from_device)
+{
+  if (block >= SIGCACHE_NUM_BLOCKS || line == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  num_from_device += from_device == true;
+  keep_line(block, generation, line);
+  pthread_mutex_unlock(&lock);
+}
+
+void sigcache_fill(uint32_t block, uint32_t generation, const char *line)
+{
+  if (block >= SIGCACHE_NUM_BLOCKS || line == NULL)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  keep_line(block, generation, line);
+  pthread_mutex_unlock(&lock);
+}
+
+void sigcache_reset(void)
+{
+  pthread_mutex_lock(&lock);
+  free(entries);
+  entries = NULL;
+  pthread_mutex_unlock(&lock);
+}
+
+void sigcache_print_stats(void)
+{
+  if (num_requests > 0)
+  {
+    fprintf(stderr, "Signatures: %ld of %ld served locally (%ld from the signature cache)\n",
+            num_requests - num_from_device, num_requests, num_hits);
+  }
+}
@@ -0,0 +1,49 @@
+#ifndef SIGCACHE_H_
+#define SIGCACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "jbod.h"
+#include "net.h"
+
+/* Client side copy of the lines JBOD_SIGN_BLOCK returns, so a block that was
+ * not written since it was last signed is not signed again. Blocks are
+ * numbered as in the volume (disk * JBOD_NUM_BLOCKS_PER_DISK + block). Every
+ * write to a block bumps its generation, which retires the line kept for it.
+ * Each function takes the sigcache's own lock, so they can be called from
+ * several threads at once, but that only protects the table: the callers
+ * (mdadm_sign_block, scrub_device) are what must not race with writes, see
+ * mdadm.h. */
+
+#define SIGCACHE_NUM_BLOCKS (JBOD_MAX_BACKENDS * JBOD_NUM_DISKS * JBOD_NUM_BLOCKS_PER_DISK)
+#define SIGCACHE_LINE_LEN 128
+
+/* Returns the generation of |block|, to be read before its contents are
+ * signed and passed to sigcache_store. */
+uint32_t sigcache_generation(uint32_t block);
+
+/* Retires the line kept for |block|, called on every write to it. */
+void sigcache_invalidate(uint32_t block);
+
+/* Returns 1 and copies the line of |block| into |line| (SIGCACHE_LINE_LEN
+ * bytes) if one is kept for its current generation, and -1 otherwise. */
+int sigcache_lookup(uint32_t block, char *line);
+
+/* Keeps |line| as the signature of |block|, unless the block was written
+ * after |generation| was read. |from_device| tells whether the JBOD signed it
+ * or it was signed locally, for the stats. */
+void sigcache_store(uint32_t block, uint32_t generation, const char *line, bool from_device);
+
+/* Same as sigcache_store for a line the JBOD returned without a lookup having
+ * missed first (see scrub_device), so it is left out of the stats. */
+void sigcache_fill(uint32_t block, uint32_t generation, const char *line);
+
+/* Forgets every line, e.g. when the JBOD is mounted again. */
+void sigcache_reset(void);
+
+/* Prints how many signatures were served without a round trip to the JBOD,
+ * if any were asked for. */
+void sigcache_print_stats(void);
+
+#endif
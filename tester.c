@@ -10,6 +10,7 @@
 #include <fcntl.h>
 #include <err.h>
 #include <assert.h>
+#include <signal.h>
 
 #include "cache.h"
 #include "jbod.h"
@@ -17,21 +18,42 @@
 #include "util.h"
 #include "tester.h"
 #include "net.h"
-
-#define TESTER_ARGUMENTS "hw:s:"
-#define USAGE                                               \
-  "USAGE: test [-h] [-w workload-file] [-s cache_size] \n"  \
-  "\n"                                                      \
-  "where:\n"                                                \
-  "    -h - help mode (display this message)\n"             \
-  "\n"                                                      \
+#include "scrub.h"
+#include "sched.h"
+#include "journal.h"
+#include "sigcache.h"
+
+#define TESTER_ARGUMENTS "hw:s:p:b:q:e:l:t:j:m:a"
+#define USAGE                                                                   \
+  "USAGE: test [-h] [-w workload-file] [-s cache_size] [-p snapshot-file]\n"    \
+  "            [-a] [-b combine_blocks] [-q fifo|elevator|deadline]\n"          \
+  "            [-e ip:port,ip:port,...] [-l concat|striped|mirrored]\n"       \
+  "            [-t tier2-file:tier2_blocks] [-j journal-file] [-m shm-name]\n"  \
+  "\n"                                                                          \
+  "where:\n"                                                                    \
+  "    -h - help mode (display this message)\n"                                 \
+  "    -p - save the cache to snapshot-file on exit and restore it on start\n"  \
+  "    -a - only cache a missed block if used more than the one it evicts\n"    \
+  "    -b - combine writes in a buffer of up to combine_blocks blocks\n"        \
+  "    -q - order in which queued block requests are sent to the JBOD\n"        \
+  "    -e - JBOD servers the volume spans (default 127.0.0.1:3333)\n"          \
+  "    -l - how the volume is laid out over the servers of -e\n"               \
+  "    -t - second cache tier of tier2_blocks blocks in tier2-file\n"           \
+  "    -j - journal the writes combined by -b in journal-file\n"                \
+  "    -m - share the cache with other testers in shared memory shm-name\n"     \
+  "\n"                                                                          \
+
+#define COMBINE_MAX_AGE_MS 100
 
 int run_workload(char *workload, int cache_size);
+static bool connect_backends(char *endpoints);
 
 int main(int argc, char *argv[])
 {
   int ch, cache_size = 0;
+  sched_policy_t policy;
   char *workload = NULL;
+  char *endpoints = NULL;
 
   while ((ch = getopt(argc, argv, TESTER_ARGUMENTS)) != -1) {
     switch (ch) {
@@ -44,6 +66,46 @@ int main(int argc, char *argv[])
       case 'w':
         workload = optarg;
         break;
+      case 'a':
+        cache_set_admission(true);
+        break;
+      case 'p':
+        cache_set_snapshot_file(optarg);
+        break;
+      case 'q':
+        if (sched_parse_policy(optarg, &policy) != 1 || sched_set_policy(policy) != 1)
+          errx(1, "Unknown scheduler %s.", optarg);
+        break;
+      case 'e':
+        endpoints = optarg;
+        break;
+      case 'l':
+        if (mdadm_set_layout(strcmp(optarg, "mirrored") == 0 ? MDADM_MIRRORED :
+                             strcmp(optarg, "striped") == 0 ? MDADM_STRIPED :
+                             strcmp(optarg, "concat") == 0 ? MDADM_CONCAT : (mdadm_layout_t) -1) != 1)
+          errx(1, "Invalid layout %s.", optarg);
+        break;
+      case 't': {
+        char *colon = strrchr(optarg, ':');
+        if (!colon)
+          errx(1, "Invalid second tier %s, expected file:blocks.", optarg);
+        *colon = '\0';
+        if (cache_set_tier2(optarg, atoi(colon + 1)) != 1)
+          errx(1, "Invalid second tier size %s.", colon + 1);
+        break;
+      }
+      case 'j':
+        if (mdadm_set_journal(optarg) != 1)
+          errx(1, "Cannot open journal %s.", optarg);
+        break;
+      case 'm':
+        if (cache_set_shared(optarg) != 1)
+          errx(1, "Invalid shared memory name %s.", optarg);
+        break;
+      case 'b':
+        if (mdadm_write_combine(atoi(optarg), COMBINE_MAX_AGE_MS) != 1)
+          errx(1, "Invalid write combining buffer size %s.", optarg);
+        break;
       default:
         fprintf(stderr, "Unknown command line option (%c), aborting.\n", ch);
         return -1;
@@ -55,7 +117,7 @@ int main(int argc, char *argv[])
     return -1;
   }
 
-  if (!jbod_connect(JBOD_SERVER, JBOD_PORT))
+  if (endpoints ? !connect_backends(endpoints) : !jbod_connect(JBOD_SERVER, JBOD_PORT))
     return -1;
   
   run_workload(workload, cache_size);
@@ -64,20 +126,28 @@ int main(int argc, char *argv[])
   return 0;
 }
 
-int equals(const char *s1, const char *s2) {
-  return strncmp(s1, s2, strlen(s2)) == 0;
-}
-
-static uint32_t encode_op(jbod_cmd_t cmd, int disk_num, int block_num) {
-  assert(cmd >= 0 && cmd < JBOD_NUM_CMDS);
-  assert(block_num >= 0 && block_num < JBOD_NUM_BLOCKS_PER_DISK);
+/* Connects to every ip:port of the comma separated list, in order, as the
+ * backends of the volume. */
+static bool connect_backends(char *endpoints) {
+  int backend = 0;
 
-uint32_t op = 0;
-  op |= cmd << 14;
-  op |= disk_num << 28;
-  op |= block_num <<20;
+  for (char *ep = strtok(endpoints, ","); ep; ep = strtok(NULL, ",")) {
+    char *colon = strchr(ep, ':');
+    if (!colon) {
+      fprintf(stderr, "Invalid endpoint %s, expected ip:port.\n", ep);
+      return false;
+    }
+    *colon = '\0';
+    if (!jbod_connect_backend(backend++, ep, atoi(colon + 1))) {
+      fprintf(stderr, "Failed to connect to %s:%s.\n", ep, colon + 1);
+      return false;
+    }
+  }
+  return backend > 0;
+}
 
-  return op;
+int equals(const char *s1, const char *s2) {
+  return strncmp(s1, s2, strlen(s2)) == 0;
 }
 
 int run_workload(char *workload, int cache_size) {
@@ -106,13 +176,28 @@ int run_workload(char *workload, int cache_size) {
       rc = mdadm_mount();
     } else if (equals(line, "UNMOUNT")) {
       rc = mdadm_unmount();
+    } else if (equals(line, "RESIZE")) {
+      int entries;
+      if (sscanf(line, "RESIZE %d", &entries) != 1)
+        errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      rc = cache_resize(entries);
+    } else if (equals(line, "CRASH")) {
+      kill(getpid(), SIGKILL);  // Dies on the spot like a crash, nothing is flushed nor unmounted
+      rc = -1;
+    } else if (equals(line, "SNAPSHOT")) {
+      rc = mdadm_snapshot_create() == -1 ? -1 : 1;
     } else if (equals(line, "SIGNALL")) {
-      for (int i = 0; i < JBOD_NUM_DISKS; ++i)
-        for (int j = 0; j < JBOD_NUM_BLOCKS_PER_DISK; ++j) {
-          uint8_t b[JBOD_BLOCK_SIZE];
-          jbod_client_operation(encode_op(JBOD_SIGN_BLOCK, i, j), b);
-          fprintf(stdout, "%s", b);
-        }
+      rc = mdadm_flush();
+      if (rc == 1 && scrub_device(SCRUB_THREADS, stdout) == -1)
+        rc = -1;
+    } else if (equals(line, "SIGN ")) {
+      uint32_t disk_num, block_num;
+      char sig[SIGCACHE_LINE_LEN];
+      if (sscanf(line, "SIGN %u %u", &disk_num, &block_num) != 2)
+        errx(1, "Failed to parse command: [%s\n], aborting.", line);
+      rc = mdadm_sign_block(disk_num, block_num, sig);
+      if (rc == 1)
+        printf("%s", sig);
     } else {
       if (sscanf(line, "%7s %7u %4u %3u", cmd, &addr, &len, &ch) != 4)
         errx(1, "Failed to parse command: [%s\n], aborting.", line);
@@ -136,6 +221,10 @@ int run_workload(char *workload, int cache_size) {
 
   jbod_print_cost();
   cache_print_hit_rate();
+  sched_print_stats();
+  sigcache_print_stats();
+  if (journal_enabled())
+    journal_print_stats();
 
   return 0;
 }
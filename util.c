@@ -3,10 +3,12 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <openssl/sha.h>
 #include <openssl/rand.h>
 
+#include "jbod.h"
 #include "util.h"
 
 static int debug_log_enabled = 0;
@@ -34,7 +36,14 @@ void debug_log(const char *fmt, ...) {
 }
 
 const char *sha1_sig(uint8_t *buf, uint32_t size) {
-  static char sig[80];
+  static char sig[SHA1_SIG_LEN];
+
+  return sha1_sig_r(buf, size, sig);
+}
+
+/* Same as sha1_sig but writes into the caller's |sig| (SHA1_SIG_LEN bytes), so
+ * it can be used from several threads at once. */
+const char *sha1_sig_r(uint8_t *buf, uint32_t size, char *sig) {
   uint8_t obuf[20];
 
   SHA1(buf, size, obuf);
@@ -45,6 +54,22 @@ const char *sha1_sig(uint8_t *buf, uint32_t size) {
   return sig;
 }
 
+/* Formats the line the JBOD server returns for JBOD_SIGN_BLOCK, so signatures
+ * computed locally can be compared with (or stand in for) the server's. */
+void format_block_sig(int disk_num, int block_num, uint8_t *buf, char *line, uint32_t size) {
+  char sig[SHA1_SIG_LEN];
+
+  snprintf(line, size, "SIG(disk,block) %2d %3d : %s\n", disk_num, block_num,
+           sha1_sig_r(buf, JBOD_BLOCK_SIZE, sig));
+}
+
+/* Returns true if every byte of buf is the same. Comparing the buffer with
+ * itself shifted by one byte lets memcmp do the work, which libc runs with
+ * vector instructions, instead of a byte by byte loop. */
+bool block_is_uniform(const uint8_t *buf, uint32_t size) {
+  return size == 0 || memcmp(buf, buf + 1, size - 1) == 0;
+}
+
 uint32_t get_rand(uint32_t min, uint32_t max) {
   uint32_t v;
   int rc = RAND_bytes((uint8_t *)&v, sizeof(v));
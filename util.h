@@ -1,13 +1,19 @@
 #ifndef UTIL_H_
 #define UTIL_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 void enable_debug_log(void);
 void set_debug_logfile(const char *filename);
 void debug_log(const char *fmt, ...);
 
+#define SHA1_SIG_LEN 80
+
 const char *sha1_sig(uint8_t *buf, uint32_t size);
+const char *sha1_sig_r(uint8_t *buf, uint32_t size, char *sig);
+void format_block_sig(int disk_num, int block_num, uint8_t *buf, char *line, uint32_t size);
 uint32_t get_rand(uint32_t min, uint32_t max);
+bool block_is_uniform(const uint8_t *buf, uint32_t size);
 
 #endif